@@ -226,3 +226,43 @@ int build_map437(int argc, char *argv[])
     map437[27] = map437[127] = NULL;
     return 0;
 }
+
+/*
+ * cp437 code for the unicode char u, '?' if there is none.
+ * The reverse table is built on the first call, without touching
+ * cp437[] which build_map437() splits in place.
+ */
+int cp437_code(uint32_t u)
+{
+    static struct { uint16_t u; uint8_t code; } rev[256];
+    static int nrev;
+    int lo, hi, i;
+
+    if (u >= 0x20 && u < 0x7f)
+	return u;
+    if (nrev == 0) {	/* sorted by insertion */
+	const char *a;
+	unsigned int code, v;
+
+	for (a = cp437; (a = strchr(a, '\n')); ) {
+	    a++;
+	    if (nrev == 256 || sscanf(a, "%x %x", &code, &v) != 2)
+		continue;
+	    for (i = nrev; i > 0 && rev[i - 1].u > v; i--)
+		rev[i] = rev[i - 1];
+	    rev[i].u = v;
+	    rev[i].code = code;
+	    nrev++;
+	}
+    }
+    for (lo = 0, hi = nrev; lo < hi; ) {
+	i = (lo + hi) / 2;
+	if (rev[i].u == u)
+	    return rev[i].code;
+	if (rev[i].u < u)
+	    lo = i + 1;
+	else
+	    hi = i;
+    }
+    return '?';
+}
@@ -100,6 +100,45 @@ struct terminal {
 	char name[0]; 	/* dynamically allocated */
 };
 
+/*
+ * Refresh pacing. Output that follows a key within echo_window is
+ * drawn at once. Otherwise refreshes are batched, and the delay
+ * doubles, up to refresh_max, while output keeps coming right after
+ * a refresh, and goes back to refresh_delay after a pause.
+ */
+enum { PACE_IDLE, PACE_ECHO, PACE_FLOOD };
+
+struct pacing {
+	uint64_t	key_time;	/* last key sent, 0 once echoed	*/
+	uint64_t	last_draw;	/* last refresh			*/
+	int		delay;		/* current refresh delay	*/
+	int		state;		/* PACE_*			*/
+	uint32_t	keys;		/* keys sent to the terminal	*/
+	uint32_t	events;		/* modified notifications	*/
+	uint32_t	echoes;		/* immediate refreshes		*/
+	uint32_t	batches;	/* deferred refreshes		*/
+	uint32_t	backoffs;	/* delay doubled		*/
+	uint32_t	draws;		/* refreshes done		*/
+	struct term_stats term;		/* of the terminal at last draw	*/
+};
+
+/*
+ * Search in the terminal history. Fn-F (text, any case) or Fn-G
+ * (regular expression) start it, typed keys extend the pattern and
+ * search again from the bottom, Up/Down move to the previous/next
+ * match, Enter leaves the match on the screen, Esc cancels.
+ */
+struct lp_search {
+	int		active;		/* keys go to the pattern	*/
+	int		flags;		/* TSR_* for the next search	*/
+	int		pending;	/* search at the next refresh	*/
+	int		len;
+	char		pat[64];
+	uint32_t	row;		/* where the next search starts	*/
+	int		col;
+	struct term_match m;		/* current match, len 0 if none	*/
+};
+
 /*
  * Overall state for the launchpad.
  * The destructor must:
@@ -133,6 +172,14 @@ struct lp_state {
 	int 		hot_interval;	/* duration of hot interval	*/
 	int		key_delay;	/* inter-key delay		*/
 	int		refresh_delay;	/* screen refresh delay		*/
+	int		refresh_max;	/* ... upper bound when flooded	*/
+	int		echo_window;	/* output this soon after a key	*/
+	int		flush_delay;	/* display update cadence	*/
+	int		upd_cost;	/* see fb_damage()		*/
+	int		ghost_limit;	/* see fb_damage()		*/
+	int		sb_lines;	/* scrollback of new terminals	*/
+	int		sb_bytes;	/* ... and its memory		*/
+	char		*term_type;	/* TERM for new terminals	*/
 	struct iodesc	kpad, fw, vol;	/* names and descriptors	*/
 
 	/* dynamic state */
@@ -140,15 +187,37 @@ struct lp_state {
 	/* fb, curterm, save_pixmap are either all set or all clear */
 	struct terminal *curterm;	/* current session		*/
 	fbscreen_t	*fb;		/* the framebuffer		*/
+	struct sess	*disp_sess;	/* display completions, if threaded */
 	dynstr		save_pixmap;	/* saved pixmap			*/
-
-	/* various timeouts, nonzero if active */
-	struct timeval	screen_due;	/* next screen refresh		*/
-	struct timeval	hotkey_due;	/* end of hotkey mode		*/
-	struct timeval	keys_due;	/* keys to send back to the kindle */
+	/* the fb of the last terminal mode, until the restore is done */
+	fbscreen_t	*closing_fb;
+	struct sess	*closing_sess;
+
+	/* the terminal as last drawn, see process_screen() */
+	struct sess	*shadow_term;	/* NULL forces a full redraw	*/
+	int		shadow_cur;	/* cursor position as drawn	*/
+	uint32_t	shadow_gen;	/* from term_state()		*/
+	dynstr		shadow;		/* the cells on the display	*/
+	int		shadow_view;	/* view as drawn		*/
+	int		shadow_hl[2];	/* highlighted cells as drawn	*/
+	/* scrollback view, see view_compose() */
+	int		view;		/* rows scrolled back		*/
+	int		view_step;	/* half screens to scroll	*/
+	uint32_t	view_hist;	/* term_state() hist when drawn	*/
+	dynstr		view_page;	/* the screen as shown		*/
+	struct lp_search search;
+
+	/* various timeouts */
+	struct timer	screen_due;	/* next screen refresh		*/
+	struct pacing	pace;		/* see term_event()		*/
+	struct timer	flush_due;	/* next display update		*/
+	struct timer	hotkey_due;	/* end of hotkey mode		*/
+	struct timer	keys_due;	/* keys to send back to the kindle */
+	struct timer	resync_due;	/* reset input state when idle	*/
 	dynstr		pending;	/* list of pending keypresses	*/
 
-	volatile int	got_signal;	/* changed by the handler */
+	int		listening;	/* input fds registered		*/
+	int		got_signal;	/* changed by the handler */
 	int		hotkey_mode;
 	int		hot_seq_len;
 #define MAXSEQ 32
@@ -157,6 +226,7 @@ struct lp_state {
 
 	/* This area must be preserved on reinit */
 	int		savearea[0];	/* area below preserved on reinit */
+	struct sess	*sess;		/* our session in the main loop	*/
 	struct terminal *allterm;	/* all terminal sessions	*/
 	char		basedir[1024];
 	char		*cfg_name;		/* points into basedir */
@@ -167,7 +237,19 @@ struct lp_state {
 static struct lp_state lpad_desc;
 static struct lp_state *lps;
 
+/* reset the input state after this long without events */
+#define RESYNC_DELAY	100000
+
 static void capture_input(int capture);
+static void process_event(struct input_event *ev, int mode);
+static void lp_listen(int on);
+static void screen_timeout(void *arg);
+static void flush_timeout(void *arg);
+static int handle_display(void *_s, struct cb_args *a);
+static int display_closed(int now);
+static void hotkey_timeout(void *arg);
+static void keys_timeout(void *arg);
+static void resync_timeout(void *arg);
 /*
  * Debugging support to emulate events on the host.
  * 1: shift down, 2: shift up other chars are up+down
@@ -289,7 +371,7 @@ static void compile_action(struct entry *k)
 			DBG(0, "%.*s key not valid as hotkey\n", len, src);
 			break;
 		}
-		DBG(2, "\t%.*s becomes %d\n", len, src, e - lps->e);
+		DBG(2, "\t%.*s becomes %d\n", len, src, (int)(e - lps->e));
 		*dst++ = e->code;
 	}
 	k->len1 = dst - (uint8_t *)k->key;
@@ -400,11 +482,23 @@ static int launchpad_init(char *path)
 	struct key_entry *e;
 
 	memset(lps, 0, (char *)&lps->savearea - (char *)lps);
+	timer_init(&lps->screen_due, screen_timeout, NULL);
+	timer_init(&lps->flush_due, flush_timeout, NULL);
+	timer_init(&lps->hotkey_due, hotkey_timeout, NULL);
+	timer_init(&lps->keys_due, keys_timeout, NULL);
+	timer_init(&lps->resync_due, resync_timeout, NULL);
 	/* load initial values */
 	lps->script_path = "";
 	lps->hot_interval = 700;
 	lps->key_delay = 50;
 	lps->refresh_delay = 100;
+	lps->refresh_max = 1000;
+	lps->echo_window = 200;
+	lps->flush_delay = 100;
+	lps->upd_cost = 16384;
+	lps->ghost_limit = 50;
+	lps->sb_lines = 2000;
+	lps->sb_bytes = 256 * 1024;
 	lps->kpad.fdin = lps->fw.fdin = lps->vol.fdin = -1;
 	if (path == NULL)
 		path = lps->cfg_name;
@@ -425,6 +519,14 @@ static int launchpad_init(char *path)
 	setVal(sec, "ScriptDirectory", 's', &lps->script_path);
 	setVal(sec, "InterKeyDelay", 'i', &lps->key_delay);
 	setVal(sec, "RefreshDelay", 'i', &lps->refresh_delay);
+	setVal(sec, "RefreshMax", 'i', &lps->refresh_max);
+	setVal(sec, "EchoWindow", 'i', &lps->echo_window);
+	setVal(sec, "FlushDelay", 'i', &lps->flush_delay);
+	setVal(sec, "UpdateCost", 'i', &lps->upd_cost);
+	setVal(sec, "GhostLimit", 'i', &lps->ghost_limit);
+	setVal(sec, "ScrollLines", 'i', &lps->sb_lines);
+	setVal(sec, "ScrollBytes", 'i', &lps->sb_bytes);
+	setVal(sec, "TermType", 's', &lps->term_type);
 	setVal(sec, "KpadIn", 's', &lps->kpad.namein);
 	setVal(sec, "KpadOut", 's', &lps->kpad.nameout);
 	setVal(sec, "FwIn", 's', &lps->fw.namein);
@@ -711,22 +813,35 @@ static int execute_action(const struct entry *k)
 			DBG(0, "start %s got %p\n", p+1, t);
 			if (t == NULL)
 				return 1;
+			display_closed(1);	/* fb_open() reuses it */
 			lps->fb = fb_open();	/* also mark terminal mode */
 			if (lps->fb) {	/* if success, input is for us */
 				pixmap_t *pix = &lps->fb->pixmap;
 				int l = pix->width * pix->height * pix->bpp / 8;
 				lps->curterm = t;
+				lps->shadow_term = NULL;
+				lps->view = lps->view_step = 0;
+				lps->search.active = lps->search.m.len = 0;
+				lps->fb->upd_cost = lps->upd_cost;
+				lps->fb->ghost_limit = lps->ghost_limit;
+				if (lps->fb->donefd >= 0) {
+					lps->disp_sess = new_sess(sizeof(struct sess),
+						-2, handle_display, NULL);
+					if (lps->disp_sess)
+						sess_watch(lps->disp_sess,
+						    lps->fb->donefd, SE_READ);
+				}
 				ds_reset(lps->save_pixmap);
 				ds_append(&lps->save_pixmap, pix->surface, l);
 				//print_help();
 				capture_input(1) ;
 				// set a timeout to popup the terminal
-				gettimeofday(&lps->screen_due, NULL);
+				timer_arm(&lps->screen_due, 0);
 			}
 			return 0;
 		}
 		DBG(1, "call system %s\n", p+1);
-		return system(p+1);
+		return sess_system(p+1);
 
 	case '@':	/* take keys from file, then as above */
 		asprintf(&tmp, "%s/%s", lps->script_path, p+1);
@@ -756,7 +871,9 @@ static int execute_action(const struct entry *k)
 	if (must_free)
 		free(must_free);
 	DBG(1, "sent %d keys\n", ds_len(lps->pending)/2);
-	gettimeofday(&lps->keys_due, NULL);
+	/* stop reading input until all keys are sent */
+	lp_listen(ds_len(lps->pending) == 0);
+	timer_arm(&lps->keys_due, 0);
 	return 0 ;
 }
 
@@ -768,12 +885,10 @@ static int execute_action(const struct entry *k)
 static void capture_input(int capture)
 {
 	capture = capture ? 1 : 0 ; /* normalize */
-	if (capture) {
-		gettimeofday(&lps->hotkey_due, NULL);
-		timeradd_ms(&lps->hotkey_due, lps->hot_interval, &lps->hotkey_due);
-	} else {
-		timerclear(&lps->hotkey_due);
-	}
+	if (capture)
+		timer_arm(&lps->hotkey_due, lps->hot_interval);
+	else
+		timer_cancel(&lps->hotkey_due);
 #ifndef __FreeBSD__
 	if (lps->kpad.fdin != -1 && ioctl(lps->kpad.fdin, EVIOCGRAB, capture))
     		perror("Capture kbd input:");
@@ -793,7 +908,7 @@ static void call_hotkey(int mode)
 */
 
 	DBG(1, "%s\n", mode ? "direct" : "timeout");
-	timerclear(&lps->hotkey_due);
+	timer_cancel(&lps->hotkey_due);
 	if (!lps->hotkey_mode)
 		return;
 	capture_input(0) ;
@@ -819,29 +934,122 @@ static void call_hotkey(int mode)
 	lps->hot_seq_len = 0 ;
 }
 
+/*
+ * Close the fb of the terminal mode that ended, once the display
+ * thread has issued the restore, or at once if 'now'.
+ * Returns 0 if still waiting.
+ */
+static int display_closed(int now)
+{
+	struct sess *s = lps->closing_sess;
+
+	if (s == NULL)
+		return 1;
+	if (!now && fb_done(lps->closing_fb) > 0)
+		return 0;
+	sess_watch(s, lps->closing_fb->donefd, 0);
+	fb_close(lps->closing_fb);	/* waits for the worker */
+	lps->closing_fb = NULL;
+	lps->closing_sess = NULL;
+	if (now)	/* it frees itself */
+		sess_ready(s, SE_WAKEUP);
+	return 1;
+}
+
 static void curterm_end(void)
 {
 	int l = ds_len(lps->save_pixmap);
 
 	DBG(0, "exit from terminal mode\n");
-	if (l && lps->fb) {
+	timer_cancel(&lps->flush_due);	/* the restore covers all */
+	if (lps->curterm) {	/* nobody refreshes it now */
+		struct term_state st = { .flags = TS_FLOW, .flow = 0 };
+		term_state(lps->curterm->the_shell, &st);
+	}
+	if (l && lps->fb) {	/* through the queue, never waiting */
 		pixmap_t *p = &lps->fb->pixmap;
 		memcpy(p->surface, ds_data(lps->save_pixmap), l);
 		ds_reset(lps->save_pixmap);
-		fb_update_area(lps->fb, UMODE_PARTIAL, 0, 0, p->width, p->height, NULL);
+		lps->fb->ghost_limit = 0;	/* a partial update */
+		fb_damage(lps->fb, 0, 0, p->width, p->height);
+		fb_flush(lps->fb);
+	}
+	if (lps->disp_sess) {	/* handle_display() closes the fb */
+		lps->closing_fb = lps->fb;
+		lps->closing_sess = lps->disp_sess;
+		lps->disp_sess = NULL;
+		sess_ready(lps->closing_sess, SE_WAKEUP);
+	} else {
+		fb_close(lps->fb);
 	}
-	fb_close(lps->fb);
 	lps->curterm = NULL;
 	lps->fb = NULL;
 	capture_input(0);
 }
 
+/* scroll the view back (dir > 0) or forward by half a screen */
+static void lp_view(int dir)
+{
+	lps->view_step += dir;	/* applied by process_screen() */
+	timer_arm(&lps->screen_due, 0);
+}
+
+/* start a search, flags as in term_search() */
+static void lp_search_start(int flags)
+{
+	struct lp_search *s = &lps->search;
+
+	s->active = 1;
+	s->flags = flags | TSR_BACK;
+	s->len = 0;
+	s->pat[0] = '\0';
+	s->m.len = 0;
+}
+
+/* a key in search mode */
+static void lp_search_key(const char *k)
+{
+	struct lp_search *s = &lps->search;
+
+	if (!strcmp(k, "\e[A") || !strcmp(k, "\e[B")) {	/* move */
+		if (s->m.len == 0)
+			return;
+		s->flags = (k[2] == 'A') ? s->flags | TSR_BACK :
+			s->flags & ~TSR_BACK;
+		s->row = s->m.row;
+		s->col = s->m.col + (k[2] == 'B');
+	} else if (k[0] == 0x1b) {	/* cancel */
+		s->active = s->m.len = 0;
+		lps->view = lps->view_step = 0;
+		timer_arm(&lps->screen_due, 0);
+		return;
+	} else if (k[0] == 13) {
+		s->active = 0;
+		return;
+	} else {
+		if (k[0] == 0x7f && s->len > 0)
+			s->len--;
+		else if (!k[1] && isprint((uint8_t)k[0]) &&
+		    s->len < sizeof(s->pat) - 1)
+			s->pat[s->len++] = k[0];
+		else
+			return;
+		s->pat[s->len] = '\0';
+		s->flags |= TSR_BACK;	/* again from the bottom */
+		s->row = ~0;
+		s->col = 0;
+	}
+	s->pending = 1;
+	timer_arm(&lps->screen_due, 0);
+}
+
 /*
  * pass keys to the terminal code, conversion etc. will happen there
  */
 static void process_term(struct input_event *ev, int mode)
 {
 	char k[16];
+	int nul = 0;	/* ctrl-space sends a NUL */
 	struct key_entry *e = lps->by_code[ev->code];
 	/* simulate ctrl, shift, sym keys */
 	static int ctrl = 0;
@@ -887,6 +1095,15 @@ static void process_term(struct input_event *ev, int mode)
 				NULL };
 			int i;
 			char c = ' ';
+			if (E_IS(e, "Up") || E_IS(e, "Down")) {
+				lp_view(E_IS(e, "Up") ? 1 : -1);
+				return;
+			}
+			if (E_IS(e, "f") || E_IS(e, "g")) {
+				lp_search_start(E_IS(e, "f") ?
+					TSR_ICASE : TSR_REGEX);
+				return;
+			}
 			if (e->namelen == 1)
 				c = e->name[0];
 			else if (E_IS(e, "Del"))
@@ -935,6 +1152,8 @@ static void process_term(struct input_event *ev, int mode)
 			}
 		} else if (E_IS(e, "Enter"))
 			k[0] = 13;
+		else if (E_IS(e, "Space") && ctrl && !shift)
+			nul = 1;	/* k stays empty */
 		else if (E_IS(e, "Space"))
 			k[0] = ' ';
 		else if (E_IS(e, "Del"))
@@ -961,11 +1180,39 @@ static void process_term(struct input_event *ev, int mode)
 		else if (ev->code == lps->term_fn)
 			fn = 0;
 	}
-	if (lps->curterm)
-		term_keyin(lps->curterm->the_shell, k);
+	if (lps->curterm && k[0] && lps->search.active) {
+		lp_search_key(k);
+	} else if (lps->curterm && (k[0] || nul)) {
+		if (lps->view || lps->view_step || lps->search.m.len) {
+			/* back to the bottom */
+			lps->view = lps->view_step = 0;
+			lps->search.m.len = 0;
+			timer_arm(&lps->screen_due, 0);
+		}
+		lps->pace.key_time = now_ms();
+		lps->pace.keys++;
+		term_keyin(lps->curterm->the_shell, k, nul ? 1 : strlen(k));
+	}
 }
 
 
+/*
+ * draw the unicode char cp at x, y with the background from attr,
+ * highlighted if it is under the cursor. The font is cp437, combining
+ * marks are not drawn and wide chars take one cell.
+ */
+static void draw_char(int x, int y, uint32_t cp, unsigned char attr,
+	int cursor)
+{
+	unsigned char bg = (attr & 0x38) >> 2; /* background color */
+
+	bg = bg | (bg << 4);
+	if (cursor)
+		bg |= 0x88;
+	fb_char_at(lps->fb, NULL, x, y, cp437_code(cp), bg);
+}
+
+#if 0	/* only used by print_help() */
 /*
  * print a buffer at x, y. If attr, use attributes array
  * Wrap after 'cols'.
@@ -974,29 +1221,21 @@ static void print_buf(int x0, int y0, int cols, int cur,
 	const uint8_t *buf, int len, const uint8_t *attr, int bg0)
 {
         int i, x = x0, y = y0;
-        pixmap_t char_pixmap;
+        const struct font *f = lps->fb->font;
 
         for (i=0; i < len; i++) {
-            unsigned char cc = buf[i];
-            unsigned char bg = attr ? attr[i] : (bg0 << 2);
-            bg = (bg & 0x38) >> 2; /* background color */
-
-            bg = bg | (bg << 4);
-	    if ( i == cur )
-		bg |= 0x88;
-	    get_char_pixmap(lps->fb->font, cc, &char_pixmap) ;
-	    pix_blt(&lps->fb->pixmap, x, y,
-			&char_pixmap, 0, 0, -1, -1, bg) ;
-	    x += char_pixmap.width;
+	    draw_char(x, y, buf[i], attr ? attr[i] : (bg0 << 2), i == cur);
+	    x += f->width;
 	    if ( (i+1) % cols == 0) {
 		x = x0;
-		y += char_pixmap.height;
+		y += f->height;
 	    }
         }
 	fb_update_area(lps->fb, UMODE_PARTIAL, x0, y0,
-		cols*(char_pixmap.width), y - y0, NULL) ;
+		cols*(f->width), y - y0, NULL) ;
 	DBG(2, "end\n");
 }
+#endif
 
 /*
  * static void print_help(void)
@@ -1019,29 +1258,252 @@ static void print_buf(int x0, int y0, int cols, int cur,
  *}
  */
 	
+#define XOFS 0	/* horizontal offset */
+#define YOFS 0	/* vertical offset */
+
+/*
+ * queue the cells in rows y0..y1-1, columns x0..x1-1 for the display,
+ * updates go out at most every flush_delay ms.
+ */
+static void update_cells(int x0, int y0, int x1, int y1)
+{
+	const struct font *f = lps->fb->font;
+
+	DBG(2, "rows %d-%d cols %d-%d\n", y0, y1 - 1, x0, x1 - 1);
+	fb_damage(lps->fb, XOFS + x0 * f->width,
+		YOFS + y0 * f->height, (x1 - x0) * f->width,
+		(y1 - y0) * f->height);
+	if (!timer_pending(&lps->flush_due))
+		timer_arm(&lps->flush_due, lps->flush_delay);
+}
+
+/* run a pending search, and scroll the view to show the match */
+static void search_run(const struct term_state *st)
+{
+	struct lp_search *s = &lps->search;
+	int r;
+
+	if (!s->pending)
+		return;
+	s->pending = 0;
+	if (s->len == 0 || term_search(lps->curterm->the_shell, st,
+	    s->pat, s->flags, s->row, s->col, &s->m)) {
+		s->m.len = 0;
+		return;
+	}
+	r = s->m.row - st->hist + lps->view;	/* on the screen */
+	if (r < 0 || r >= st->rows)
+		lps->view = st->hist + st->rows / 2 - s->m.row;
+}
+
+/*
+ * The screen scrolled back by v rows: screen row r shows scrollback
+ * row hist - v + r above the page, page row r - v below.
+ */
+static const term_cell *view_compose(const struct term_state *st, int v)
+{
+	int r, c, l = st->rows * st->cols * sizeof(term_cell);
+	term_cell *d;
+
+	ds_reset(lps->view_page);
+	ds_append(&lps->view_page, st->cells, l);
+	if (ds_len(lps->view_page) != l)
+		return st->cells;
+	d = (term_cell *)ds_data(lps->view_page);
+	if (v < st->rows)
+		memmove(d + v * st->cols, d,
+			(st->rows - v) * st->cols * sizeof(term_cell));
+	for (r = 0; r < v && r < st->rows; r++) {
+		term_cell *x = d + r * st->cols;
+
+		if (term_sb_row(lps->curterm->the_shell, st->hist - v + r, x))
+			for (c = 0; c < st->cols; c++)
+				x[c] = CELL(' ', 0);
+	}
+	return d;
+}
+
+#define IN_SPAN(i, s)	((i) >= (s)[0] && (i) < (s)[1])
+
+/*
+ * Follow a move of rows (see struct term_move) on the display and in
+ * the shadow, so the moved cells need no drawing. A cursor in the
+ * rows is forgotten and its cell marked as different, wherever the
+ * move left it. Returns the cursor in the shadow.
+ */
+static int shadow_move(const struct term_move *mv, int cols, int ocur)
+{
+	term_cell *sd = (term_cell *)ds_data(lps->shadow);
+	const struct font *f = lps->fb->font;
+	int k = mv->n < 0 ? -mv->n : mv->n, h = mv->bottom - mv->top - k;
+	int src = mv->top + (mv->n > 0 ? k : 0);
+	int dst = mv->top + (mv->n > 0 ? 0 : k);
+
+	if (fb_move(lps->fb, XOFS, YOFS + src * f->height, cols * f->width,
+	    h * f->height, (dst - src) * f->height))
+		return ocur;
+	if (ocur >= mv->top * cols && ocur < mv->bottom * cols) {
+		sd[ocur] = ~0;	/* no cell looks like this */
+		ocur = -1;
+	}
+	memmove(sd + dst * cols, sd + src * cols, h * cols * sizeof(*sd));
+	update_cells(0, mv->top, cols, mv->bottom);
+	return ocur;
+}
+
 /*
  * update the screen. We know the state is 'modified' so we
  * don't need to read it, just notify it and fetch data.
- * XXX to optimize the code we could store a copy of the prev
- * window so we only update smaller regions of the screen.
+ * The shadow holds what is on the display: we only look at the rows
+ * that term_state() reports as changed, draw the cells that differ,
+ * and update the display in rectangles made of consecutive rows
+ * with changes. While scrolled back (lps->view) all rows are compared,
+ * and the view stays on the same rows as output arrives. Rows that
+ * only moved since the last call are moved on the display.
+ * A search match is drawn like the cursor.
  */
 void process_screen(void)
 {
-	struct term_state st = { .flags = TS_MOD, .modified = 0};
-	uint8_t *d;
-
-#define XOFS 0	/* horizontal offset */
-#define YOFS 0	/* vertical offset */
-
-	timerclear(&lps->screen_due);
+	/* with flow control a flooding child waits for our refreshes */
+	struct term_state st = { .flags = TS_MOD | TS_FLOW, .modified = 0,
+		.flow = 1 };
+	const term_cell *d;
+	term_cell *sd;
+	int r, c, i, l, full, all, ocur, cur;
+	int rx0 = 0, rx1 = 0, ry0 = -1;	/* pending rectangle */
+	int hl[2] = { 0, 0 }, *ohl = lps->shadow_hl;	/* search match */
+
+	timer_cancel(&lps->screen_due);
 	if (!lps->curterm || !lps->fb)
 		return;
+	lps->pace.last_draw = now_ms();
+	lps->pace.draws++;
 	term_state(lps->curterm->the_shell, &st);
-	d = (unsigned char *)st.data;
+	lps->pace.term = st.stats;
+	l = st.rows * st.cols;
+	d = st.cells;
+	cur = st.cur;
+	if (lps->view)
+		lps->view += st.hist - lps->view_hist;
+	lps->view += lps->view_step * st.rows / 2;
+	lps->view_step = 0;
+	search_run(&st);
+	if (lps->view > st.hist_rows)
+		lps->view = st.hist_rows;
+	if (lps->view < 0)
+		lps->view = 0;
+	lps->view_hist = st.hist;
+	if (lps->view) {
+		d = view_compose(&st, lps->view);
+		cur = (cur >= 0 && cur < l - lps->view * st.cols) ?
+			cur + lps->view * st.cols : -1;
+	}
+	r = lps->search.m.row - st.hist + lps->view;
+	if (lps->search.m.len && r >= 0 && r < st.rows) {
+		hl[0] = r * st.cols + lps->search.m.col;
+		hl[1] = hl[0] + lps->search.m.len;
+		if (hl[1] > (r + 1) * st.cols)
+			hl[1] = (r + 1) * st.cols;
+	}
 
-	print_buf(XOFS, YOFS, st.cols, st.cur, d, st.rows * st.cols,
-		d + st.rows * st.cols, 0);
+	full = lps->shadow_term != lps->curterm->the_shell ||
+		ds_len(lps->shadow) != l * sizeof(term_cell);
+	if (full) {
+		ds_reset(lps->shadow);
+		ds_append(&lps->shadow, d, l * sizeof(term_cell));
+		lps->shadow_term = lps->curterm->the_shell;
+	}
+	sd = (term_cell *)ds_data(lps->shadow);
+	ocur = lps->shadow_cur;
+	all = full || lps->view || lps->shadow_view;
+	if (!all && st.move.n && lps->shadow_gen + 1 == st.gen &&
+	    hl[0] == hl[1] && ohl[0] == ohl[1])
+		ocur = shadow_move(&st.move, st.cols, ocur);
+
+	for (r = 0; r < st.rows; r++) {
+		int x0 = st.cols, x1 = 0;	/* columns drawn */
+
+		if (all || term_row_changed(&st, r, lps->shadow_gen) ||
+		    (ocur >= 0 && ocur / st.cols == r) ||
+		    (cur >= 0 && cur / st.cols == r) ||
+		    (hl[0] < hl[1] && hl[0] / st.cols == r) ||
+		    (ohl[0] < ohl[1] && ohl[0] / st.cols == r)) {
+			for (c = 0, i = r * st.cols; c < st.cols; c++, i++) {
+				int h = IN_SPAN(i, hl);
+
+				if (!full && d[i] == sd[i] &&
+				    (i == cur) == (i == ocur) &&
+				    h == IN_SPAN(i, ohl))
+					continue;
+				sd[i] = d[i];
+				draw_char(XOFS + c * lps->fb->font->width,
+					YOFS + r * lps->fb->font->height,
+					(d[i] & CELL_CONT) ? ' ' : d[i] & CELL_CP,
+					CELL_ATTR(d[i]), i == cur || h);
+				if (x0 > c)
+					x0 = c;
+				x1 = c + 1;
+			}
+		}
+		if (x0 < x1) {	/* extend or start the rectangle */
+			if (ry0 < 0) {
+				ry0 = r;
+				rx0 = x0;
+				rx1 = x1;
+			} else {
+				if (rx0 > x0)
+					rx0 = x0;
+				if (rx1 < x1)
+					rx1 = x1;
+			}
+		} else if (ry0 >= 0) {
+			update_cells(rx0, ry0, rx1, r);
+			ry0 = -1;
+		}
+	}
+	if (ry0 >= 0)
+		update_cells(rx0, ry0, rx1, r);
+	lps->shadow_cur = cur;
+	lps->shadow_gen = st.gen;
+	lps->shadow_view = lps->view;
+	lps->shadow_hl[0] = hl[0];
+	lps->shadow_hl[1] = hl[1];
+}
+static void screen_timeout(void *arg)
+{
+	process_screen();
 }
+
+/*
+ * send the damage to the display. If the display thread is still
+ * busy, keep merging it and let handle_display() flush when done.
+ */
+static void flush_timeout(void *arg)
+{
+	if (!lps->fb)
+		return;
+	if (lps->disp_sess && fb_done(lps->fb) > 0) {
+		DBG(2, "display busy\n");
+		return;
+	}
+	DBG(2, "%d updates\n", fb_flush(lps->fb));
+}
+
+/* updates completed in the display thread */
+static int handle_display(void *_s, struct cb_args *a)
+{
+	if (_s != lps->disp_sess) {	/* terminal mode ended */
+		if (_s == lps->closing_sess && !display_closed(0))
+			return 0;	/* the restore is not done */
+		free(_s);
+		return 1;
+	}
+	if (fb_done(lps->fb) == 0 && lps->fb->ndamage > 0 &&
+	    !timer_pending(&lps->flush_due))
+		DBG(2, "%d updates\n", fb_flush(lps->fb));
+	return 0;
+}
+
 /*
  * Process an input event from the kindle. 'mode' is the source
  */
@@ -1094,24 +1556,43 @@ static void process_event(struct input_event *ev, int mode)
 	}
 }
 
-static void hup_handler(int x)
-{
-	lps->got_signal = 1 ; /* reinit */
-}
-
-static void int_handler(int x)
+/*
+ * SIGHUP requests a reinit (got_signal = 1), SIGINT and SIGTERM
+ * an exit (got_signal = 2). The work is done in handle_launchpad().
+ */
+static void lp_signal(int sig, void *arg)
 {
-	lps->got_signal = 2 ; /* exit */
+	lps->got_signal = (sig == SIGHUP) ? 1 : 2;
+	if (lps->sess)
+		sess_ready(lps->sess, SE_WAKEUP);
 }
 
 static void fd_close(int *fd)
 {
 	if (*fd == -1)
 		return;
+	sess_watch(NULL, *fd, 0);	/* children may hold a copy */
 	close(*fd);
 	*fd = -1;
 }
 
+/*
+ * Register or unregister the input devices with the main loop.
+ * While we have keys to send to the kindle we do not read input.
+ */
+static void lp_listen(int on)
+{
+	int i, fds[3] = { lps->kpad.fdin, lps->fw.fdin, lps->vol.fdin };
+
+	if (lps->listening == on)
+		return;
+	lps->listening = on;
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0)
+			sess_watch(lps->sess, fds[i], on ? SE_READ : 0);
+	}
+}
+
 static void free_terminals(void)
 {
 	struct terminal *t;
@@ -1125,13 +1606,83 @@ static void free_terminals(void)
 	}
 }
 
-void term_dead(struct sess *s)
+/* schedule a refresh of the current terminal, see struct pacing */
+static void pace_refresh(void)
+{
+	struct pacing *p = &lps->pace;
+	uint64_t now = now_ms();
+
+	p->events++;
+	if (p->key_time && now - p->key_time <= lps->echo_window) {
+		p->key_time = 0;	/* one echo per key */
+		p->echoes++;
+		p->state = PACE_ECHO;
+		timer_arm(&lps->screen_due, 0);
+		return;
+	}
+	if (timer_pending(&lps->screen_due))
+		return;
+	if (p->delay < lps->refresh_delay)
+		p->delay = lps->refresh_delay;
+	if (p->draws && now - p->last_draw < p->delay) {	/* flood */
+		p->delay *= 2;
+		if (p->delay > lps->refresh_max)
+			p->delay = lps->refresh_max;
+		p->backoffs++;
+		p->state = PACE_FLOOD;
+	} else {
+		p->delay = lps->refresh_delay;
+		p->state = PACE_IDLE;
+	}
+	p->batches++;
+	DBG(2, "state %d delay %d\n", p->state, p->delay);
+	timer_arm(&lps->screen_due, p->delay);
+}
+
+static void lp_report(FILE *f, int json)
+{
+	static const char *states[] = { "idle", "echo", "flood" };
+	struct pacing *p = lps ? &lps->pace : NULL;
+
+	if (p == NULL) {
+		if (json)
+			fprintf(f, "{}");
+		return;
+	}
+	fprintf(f, json ? "{\"pace\": {\"state\": \"%s\", \"delay_ms\": %d, "
+		"\"keys\": %u, \"events\": %u, \"echoes\": %u, "
+		"\"batches\": %u, \"backoffs\": %u, \"draws\": %u}, " :
+		"  pace %s delay %d ms keys %u events %u echoes %u "
+		"batches %u backoffs %u draws %u\n",
+		states[p->state], p->delay, p->keys, p->events, p->echoes,
+		p->batches, p->backoffs, p->draws);
+	fprintf(f, json ? "\"flood\": {\"dropped\": %u, \"throttles\": %u, "
+		"\"backlog\": %d, \"backlog_max\": %d}}" :
+		"  flood dropped %u throttles %u backlog %d max %d\n",
+		p->term.dropped, p->term.throttles, p->term.backlog,
+		p->term.backlog_max);
+}
+
+/*
+ * callback for terminal events. On modifications of the current
+ * terminal schedule a refresh, on death remove the terminal.
+ */
+void term_event(struct sess *s, int event)
 {
 	struct terminal **t, *cur;
+	struct term_state st = { .flags = 0 };
+
+	if (event == TE_MODIFIED) {
+		if (lps->fb && lps->curterm && lps->curterm->the_shell == s)
+			pace_refresh();
+		return;
+	}
 	for (t = &lps->allterm; (cur = *t); t = &(*t)->next) {
 		if (cur->the_shell != s)
 			continue;
-		DBG(0, "terminal %s is dead\n", cur->name);
+		term_state(s, &st);
+		DBG(0, "terminal %s is dead, pid %d status 0x%x\n",
+			cur->name, st.pid, st.status);
 		*t = cur->next;
 		if (lps->curterm == cur)
 			curterm_end();
@@ -1161,11 +1712,14 @@ struct terminal *shell_find(const char *name)
 		return t;
 	}
 	strcpy(t->name, name);
-	t->the_shell = term_new("/bin/sh", t->name, 50, 80, term_dead);
+	term_settype(lps->term_type);
+	t->the_shell = term_new("/bin/sh", t->name, 50, 80, term_event);
 	if (!t->the_shell) {
 		free(t);
 		return NULL;
 	}
+	if (term_scrollback(t->the_shell, lps->sb_lines, lps->sb_bytes))
+		DBG(0, "no scrollback for %s\n", name);
 	t->next = lps->allterm;
 	lps->allterm  = t;
 	return t;
@@ -1179,17 +1733,26 @@ static void launchpad_deinit(int restart)
 {
 	DBG(0, "called, restart %d\n", restart);
 	lps->got_signal = 0 ;
+	timer_cancel(&lps->screen_due);
+	timer_cancel(&lps->flush_due);
+	timer_cancel(&lps->hotkey_due);
+	timer_cancel(&lps->keys_due);
+	timer_cancel(&lps->resync_due);
 	// XXX should remove the pending sessions from the scheduler ?
 	curterm_end();
+	display_closed(1);
 
 	lps->pending = ds_free(lps->pending);
-	signal(SIGINT, SIG_DFL) ;
-	signal(SIGTERM, SIG_DFL) ;
-	signal(SIGHUP, SIG_DFL) ;
+	lps->shadow = ds_free(lps->shadow);
+	lps->view_page = ds_free(lps->view_page);
+	sig_handle(SIGINT, NULL, NULL);
+	sig_handle(SIGTERM, NULL, NULL);
+	sig_handle(SIGHUP, NULL, NULL);
 
 	if (!restart)
 		free_terminals();
 	lps->hotkey_mode = 0;
+	lp_listen(0);
 	fd_close(&lps->kpad.fdin);
 	fd_close(&lps->fw.fdin);
 	fd_close(&lps->vol.fdin);
@@ -1204,103 +1767,92 @@ static void launchpad_deinit(int restart)
 
 int launchpad_start(void);
 
+static void hotkey_timeout(void *arg)
+{
+	call_hotkey(0);
+	process_event(NULL, 0);	/* resync */
+}
+
+/* send the next pending key to the kindle */
+static void keys_timeout(void *arg)
+{
+	uint8_t *p = (uint8_t *)ds_data(lps->pending);
+
+	if (ds_len(lps->pending) > 0) {
+		send_event1(p[0], p[1]);
+		ds_shift(lps->pending, 2);
+		DBG(1, "sending key, left %d\n", ds_len(lps->pending)/2);
+	}
+	if (ds_len(lps->pending) > 0)
+		timer_arm(&lps->keys_due, lps->key_delay);
+	else
+		lp_listen(1);
+}
+
+static void resync_timeout(void *arg)
+{
+	process_event(NULL, 0);
+}
+
 /*
- * callback for select.
+ * callback for the main loop. We run when input is available,
+ * or on a wakeup after a signal or a failed init.
+ * Timeouts are handled by the timers.
  * We have only one session so ignore _s
  */
 int handle_launchpad(void *_s, struct cb_args *a)
 {
 	int fds[3] = { lps->kpad.fdin, lps->fw.fdin, lps->vol.fdin };
 	int i, j, ev;
+	struct input_event kbbuf[2];
 
 	DBG(2, "fds %d %d %d\n", lps->kpad.fdin, lps->fw.fdin, lps->vol.fdin);
-	DBG(2, "term %p sh %p hotkey_due %d pend %d\n",
+	DBG(2, "term %p sh %p hotkey %d pend %d\n",
 		lps->fb, lps->curterm,
-		(int)lps->hotkey_due.tv_usec,
+		timer_pending(&lps->hotkey_due),
 		ds_len(lps->pending) );
 	if (lps->kpad.fdin < 0) { /* dead */
-		if (a->run == 0)
-			return 0;
 		/* try to restart or terminate ? */
 		launchpad_deinit(0);
+		free(_s);
 		return 1;
 	}
-	if (a->run == 0) {
-		/* create screen refresh timeout if needed */
-		if (lps->fb && lps->curterm &&
-			    term_state(lps->curterm->the_shell, NULL) &&
-			    !timerisset(&lps->screen_due))
-			timeradd_ms(&a->now, lps->refresh_delay, &lps->screen_due);
-		/* Record pending timeouts */
-		timersetmin(&a->due, &lps->screen_due);
-		timersetmin(&a->due, &lps->hotkey_due);
-		timersetmin(&a->due, &lps->keys_due);
-		/* if we have keys to send, ignore input events */
-		if (ds_len(lps->pending) > 0)
-			return 0;
-		for (i=0; i < 3; i++) {
-			if (fds[i] >= 0)
-				FD_SET(fds[i], a->r);
-			if (fds[i] > a->maxfd)
-				a->maxfd = fds[i];
-		}
-		return 1;
-	}
-
-	if (timerdue(&lps->hotkey_due, &a->now))
-		call_hotkey(0);
 	if (lps->got_signal == 1) {
 		launchpad_deinit(1);
-		launchpad_start();
-		return 0;
+		launchpad_start();	/* creates a new session */
+		free(_s);
+		return 1;
 	}
 	if (lps->got_signal == 2) {
 		launchpad_deinit(0);
-		return 0;
+		free(_s);
+		return 1;
 	}
+	/* if we have keys to send, ignore input events */
+	if (ds_len(lps->pending) > 0 || !(a->revents & SE_READ))
+		return 0;
 	ev = 0;
-	if (ds_len(lps->pending) == 0) {
-		struct input_event kbbuf[2];
-		for (j = 0; j < sizeof(fds) / sizeof(fds[0]) ; j++) {
-			int l = sizeof(struct input_event);
-			int n;
-			if (fds[j] < 0 || !FD_ISSET(fds[j], a->r))
-				continue;
-			ev = 1;	/* got an event */
-			DBG(1, "reading on %d\n", fds[j]);
+	/* we do not know which device is ready, try all of them */
+	for (j = 0; j < sizeof(fds) / sizeof(fds[0]) ; j++) {
+		int l = sizeof(struct input_event);
+		int n;
+		if (fds[j] < 0)
+			continue;
+		DBG(1, "reading on %d\n", fds[j]);
 #ifdef __FreeBSD__
-			n = host_event(fds[j], kbbuf, l);
+		n = host_event(fds[j], kbbuf, l);
 #else
-			n = read(fds[j], kbbuf, l* 2) ;
+		n = read(fds[j], kbbuf, l* 2) ;
 #endif
-			DBG(2, "got %d bytes from %d\n", n, fds[j]);
-			for (i = 0; i < 2 && n >= l; i++, n -= l) {
-				process_event(kbbuf + i, j) ;
-			}
-		}
-	}
-	/* test pending again, could have been set above */
-	if (ds_len(lps->pending) > 0) {
-		if (timerdue(&lps->keys_due, &a->now)) {
-			uint8_t *p = (uint8_t *)ds_data(lps->pending);
-			struct timeval k = { 0, lps->key_delay * 1000 };
-			send_event1(p[0], p[1]);
-			ds_shift(lps->pending, 2);
-			if (ds_len(lps->pending) > 0)
-				timeradd(&a->now, &k, &lps->keys_due);
-			else
-				timerclear(&lps->keys_due);
-			DBG(1, "sending key, left %d\n", ds_len(lps->pending)/2);
+		DBG(2, "got %d bytes from %d\n", n, fds[j]);
+		if (n > 0)
+			ev = 1;	/* got an event */
+		for (i = 0; i < 2 && n >= l; i++, n -= l) {
+			process_event(kbbuf + i, j) ;
 		}
-		return 0;
-	}
-	if (timerdue(&lps->screen_due, &a->now)) {
-		process_screen();
-		return 0;
-	}
-	if (ev == 0) { /* timeout ? resync ? */
-		process_event(NULL, 0);
 	}
+	if (ev)
+		timer_arm(&lps->resync_due, RESYNC_DELAY);
 	return 0;
 }
 
@@ -1335,17 +1887,23 @@ int launchpad_parse(int *ac, char *av[])
 
 int launchpad_start(void)
 {
-	new_sess(0, -2, handle_launchpad, NULL);
-	signal(SIGINT, int_handler);
-	signal(SIGTERM, int_handler);
-	signal(SIGHUP, hup_handler);
+	lps->sess = new_sess(sizeof(struct sess), -2, handle_launchpad, NULL);
+	if (lps->sess == NULL)
+		return 1;
+	sig_handle(SIGINT, lp_signal, NULL);
+	sig_handle(SIGTERM, lp_signal, NULL);
+	sig_handle(SIGHUP, lp_signal, NULL);
 	process_event(NULL, 0);	/* reset args */
-	if (!launchpad_init(NULL))
+	if (!launchpad_init(NULL)) {
+		lp_listen(1);
 		return 0;
+	}
 	DBG(0, "init routine failed, exiting\n");
 	launchpad_deinit(0) ;
+	sess_ready(lps->sess, SE_WAKEUP);	/* let the session die */
 	return 0 ;
 }
 
 struct app lpad = { .parse = launchpad_parse,
-	.start = launchpad_start, .data = &lpad_desc};
+	.start = launchpad_start, .data = &lpad_desc, .name = "launchpad",
+	.report = lp_report };
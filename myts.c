@@ -29,14 +29,45 @@
 Framework for event based programming.
 Each application supplies a descriptor with init, parse, start
 routine and a pointer to app-specific data.
-Each application is then expected to record handlers that are called before
-and after a select() to define which descriptors to poll, and when
-a timeout is due.
+Each application is then expected to record handlers, and register
+through sess_watch() the descriptors they want to poll. Handlers are
+called only when one of their descriptors is ready.
+Timers, signals and child termination are dispatched by the loop too.
+The loop uses epoll() on linux, and select() elsewhere or when
+compiled with -DUSE_SELECT.
 
  */
 
 #include "myts.h"
 #include <sys/wait.h>
+#include <errno.h>
+#include <time.h>	/* clock_gettime */
+#ifdef linux
+#include <sys/signalfd.h>
+#define USE_SIGNALFD
+#endif
+
+#if defined(linux) && !defined(USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#define MAX_EVENTS	64	/* events returned by one epoll_wait() */
+#else
+/* descriptors registered with sess_watch(), indexed by fd */
+static struct {
+	struct sess *s;
+	int events;
+} watch[FD_SETSIZE];
+static int watch_max = -1;	/* highest registered fd */
+#endif
+
+/* handlers registered with sig_handle(), indexed by signal */
+static struct {
+	void (*fn)(int sig, void *arg);
+	void *arg;
+} sig_table[NSIG];
+#ifndef USE_SIGNALFD
+static int sig_pipe[2] = { -1, -1 };	/* self-pipe for the handler */
+#endif
 
 /* ugly to include the C source, but this simplifies use with tcc -run */
 #ifndef SPLIT
@@ -65,25 +96,302 @@ struct app *all_apps[] = {
 	NULL,
 };
 
-/* add a millisecond value to a timer */
-void timeradd_ms(const struct timeval *src, int ms, struct timeval *dst)
+uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Profiler, see struct loop_prof. Timestamps are in microseconds.
+ */
+static uint64_t now_us(void)
 {
-        dst->tv_usec = src->tv_usec + (ms*1000);
-        dst->tv_sec = src->tv_sec + dst->tv_usec / 1000000;
-        dst->tv_usec %= 1000000;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
-               
-/* set dst to the min of the two -- if cur is unset, ignore */
-void timersetmin(struct timeval *dst, const struct timeval *cur)
-{       
-        if (timerisset(cur) && timercmp(cur, dst, <))
-                *dst = *cur;
+
+static void prof_add(struct prof_hist *h, uint64_t us)
+{
+	uint64_t v = us;
+	int i;
+
+	for (i = 0; v && i < PROF_BUCKETS - 1; i++)
+		v >>= 1;
+	h->bucket[i]++;
+	h->count++;
+	h->total += us;
+	if (us > h->max)
+		h->max = us > 0xffffffff ? 0xffffffff : us;
 }
 
-/* returns true if dst set and <= 'now' */
-int timerdue(const struct timeval *dst, const struct timeval *now)
-{       
-        return (timerisset(dst) && timercmp(dst, now, <=));
+static const char *prof_causes[PW_MAX] = {
+	"fd", "timer", "signal", "ready", "idle" };
+
+static void prof_hist_print(FILE *f, const char *name,
+	const struct prof_hist *h, int json)
+{
+	int i, last;
+
+	for (last = PROF_BUCKETS - 1; last > 0 && !h->bucket[last]; last--)
+		;
+	if (json) {
+		fprintf(f, "\"%s\": {\"count\": %u, \"total_us\": %llu, "
+			"\"max_us\": %u, \"buckets\": [", name, h->count,
+			(unsigned long long)h->total, h->max);
+		for (i = 0; i <= last; i++)
+			fprintf(f, "%s%u", i ? ", " : "", h->bucket[i]);
+		fprintf(f, "]}");
+		return;
+	}
+	fprintf(f, "  %-8s n %u avg %llu max %u us:", name, h->count,
+		h->count ? (unsigned long long)(h->total / h->count) : 0ULL,
+		h->max);
+	for (i = 0; i <= last; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+		if (i == PROF_BUCKETS - 1)
+			fprintf(f, " >=%u:%u", 1U << (i - 1), h->bucket[i]);
+		else
+			fprintf(f, " <%u:%u", 1U << i, h->bucket[i]);
+	}
+	fprintf(f, "\n");
+}
+
+static void prof_wakeups_print(FILE *f, const uint32_t *w, int json)
+{
+	int i;
+
+	fprintf(f, json ? "\"wakeups\": {" : " wakeups");
+	for (i = 0; i < PW_MAX; i++) {
+		if (json)
+			fprintf(f, "%s\"%s\": %u", i ? ", " : "",
+				prof_causes[i], w[i]);
+		else
+			fprintf(f, " %s %u", prof_causes[i], w[i]);
+	}
+	fprintf(f, json ? "}" : "\n");
+}
+
+/* one entry for an app (s == NULL) or a session */
+static void prof_entry_print(FILE *f, struct app *app, struct sess *s,
+	int json)
+{
+	const struct prof *p = s ? &s->prof : &app->prof;
+	const char *name = (app && app->name) ? app->name : "-";
+
+	if (json) {
+		fprintf(f, "{\"app\": \"%s\", ", name);
+		if (s)
+			fprintf(f, "\"sess\": \"%p\", \"fd\": %d, ", s, s->fd);
+		prof_wakeups_print(f, p->wakeups, 1);
+		fprintf(f, ", ");
+		prof_hist_print(f, "run", &p->run, 1);
+		if (!s && app && app->report) {
+			fprintf(f, ", \"stats\": ");
+			app->report(f, 1);
+		}
+		fprintf(f, "}");
+		return;
+	}
+	if (s)
+		fprintf(f, "session %p app %s fd %d:", s, name, s->fd);
+	else
+		fprintf(f, "app %s:", name);
+	prof_wakeups_print(f, p->wakeups, 0);
+	prof_hist_print(f, "run", &p->run, 0);
+	if (!s && app && app->report)
+		app->report(f, 0);
+}
+
+void prof_dump(FILE *f, int json)
+{
+	struct my_args *me = &__me;
+	struct loop_prof *p = &me->prof;
+	struct app **app;
+	struct sess *s, *lists[2] = { me->sess, me->tmp_sess };
+	int i, n;
+	uint64_t up = now_us() - p->start;
+
+	if (json) {
+		fprintf(f, "{\"uptime_ms\": %llu, \"loops\": %u, ",
+			(unsigned long long)(up / 1000), p->loops);
+		prof_wakeups_print(f, p->wakeups, 1);
+		fprintf(f, ",\n ");
+		prof_hist_print(f, "wait", &p->wait, 1);
+		fprintf(f, ",\n ");
+		prof_hist_print(f, "run", &p->run, 1);
+		fprintf(f, ",\n ");
+		prof_hist_print(f, "timers", &p->timers, 1);
+		fprintf(f, ",\n ");
+		prof_hist_print(f, "signals", &p->signals, 1);
+		fprintf(f, ",\n \"apps\": [");
+		for (n = 0, app = me->all_apps; *app; app++, n++) {
+			fprintf(f, "%s\n  ", n ? "," : "");
+			prof_entry_print(f, *app, NULL, 1);
+		}
+		fprintf(f, "],\n \"sessions\": [");
+		for (n = i = 0; i < 2; i++) {
+			for (s = lists[i]; s; s = s->next, n++) {
+				fprintf(f, "%s\n  ", n ? "," : "");
+				prof_entry_print(f, s->app, s, 1);
+			}
+		}
+		fprintf(f, "]}\n");
+	} else {
+		fprintf(f, "loop: %llu.%03u s, %u loops,",
+			(unsigned long long)(up / 1000000),
+			(unsigned)(up / 1000 % 1000), p->loops);
+		prof_wakeups_print(f, p->wakeups, 0);
+		prof_hist_print(f, "wait", &p->wait, 0);
+		prof_hist_print(f, "run", &p->run, 0);
+		prof_hist_print(f, "timers", &p->timers, 0);
+		prof_hist_print(f, "signals", &p->signals, 0);
+		for (app = me->all_apps; *app; app++)
+			prof_entry_print(f, *app, NULL, 0);
+		for (i = 0; i < 2; i++) {
+			for (s = lists[i]; s; s = s->next)
+				prof_entry_print(f, s->app, s, 0);
+		}
+	}
+	fflush(f);
+}
+
+/* SIGUSR1: text report on stderr, JSON to the --profile file */
+static void prof_signal(int sig, void *arg)
+{
+	FILE *f;
+
+	prof_dump(stderr, 0);
+	if (__me.prof_file == NULL)
+		return;
+	f = fopen(__me.prof_file, "w");
+	if (f == NULL) {
+		DBG(0, "cannot open %s\n", __me.prof_file);
+		return;
+	}
+	prof_dump(f, 1);
+	fclose(f);
+}
+
+/*
+ * Timer heap. The heap is 1-based so the parent of i is i/2
+ * and t->slot == 0 means 'not armed'.
+ */
+static void heap_set(struct timer **h, int i, struct timer *t)
+{
+	h[i] = t;
+	t->slot = i;
+}
+
+/* move the timer at slot i up or down until the heap is valid */
+static void heap_fix(struct my_args *me, int i)
+{
+	struct timer **h = me->timers, *t = h[i];
+	int c;
+
+	for (; i > 1 && h[i/2]->due > t->due; i /= 2)
+		heap_set(h, i, h[i/2]);
+	for (; (c = 2*i) <= me->ntimers; i = c) {
+		if (c < me->ntimers && h[c+1]->due < h[c]->due)
+			c++;
+		if (h[c]->due >= t->due)
+			break;
+		heap_set(h, i, h[c]);
+	}
+	heap_set(h, i, t);
+}
+
+void timer_init(struct timer *t, void (*fn)(void *), void *arg)
+{
+	timer_cancel(t);
+	t->fn = fn;
+	t->arg = arg;
+}
+
+int timer_arm(struct timer *t, int ms)
+{
+	struct my_args *me = &__me;
+
+	t->due = now_ms() + (ms > 0 ? ms : 0);
+	t->gen = me->timer_gen;
+	if (t->slot) {	/* already armed, just move it */
+		heap_fix(me, t->slot);
+		return 0;
+	}
+	if (me->ntimers + 1 >= me->timers_size) {
+		int n = me->timers_size ? 2 * me->timers_size : 16;
+		struct timer **h = realloc(me->timers, n * sizeof(*h));
+		if (h == NULL) {
+			DBG(0, "cannot grow timer heap to %d\n", n);
+			return -1;
+		}
+		me->timers = h;
+		me->timers_size = n;
+	}
+	me->ntimers++;
+	heap_set(me->timers, me->ntimers, t);
+	heap_fix(me, me->ntimers);
+	return 0;
+}
+
+void timer_cancel(struct timer *t)
+{
+	struct my_args *me = &__me;
+	int i = t->slot;
+
+	if (i == 0)
+		return;
+	t->slot = 0;
+	if (i != me->ntimers) {	/* fill the hole with the last one */
+		heap_set(me->timers, i, me->timers[me->ntimers]);
+		me->ntimers--;
+		heap_fix(me, i);
+	} else {
+		me->ntimers--;
+	}
+}
+
+/* ms until the first timer expires, or 'max' if none is armed */
+static int timer_next(struct my_args *me, uint64_t now, int max)
+{
+	uint64_t due;
+
+	if (me->ntimers == 0)
+		return max;
+	due = me->timers[1]->due;
+	if (due <= now)
+		return 0;
+	return (due - now < max) ? due - now : max;
+}
+
+/*
+ * Run expired timers and return how many. Timers re-armed by a
+ * callback during this pass wait for the next iteration, otherwise
+ * a zero delay would make us spin here.
+ */
+static int run_timers(struct my_args *me, uint64_t now)
+{
+	struct timer *t;
+	uint64_t t0;
+	int n = 0;
+
+	me->timer_gen++;
+	while (me->ntimers > 0) {
+		t = me->timers[1];
+		if (t->due > now || t->gen == me->timer_gen)
+			break;
+		timer_cancel(t);
+		t0 = now_us();
+		t->fn(t->arg);
+		prof_add(&me->prof.timers, now_us() - t0);
+		n++;
+	}
+	return n;
 }
 
 /* generic socket open routine. */
@@ -154,85 +462,379 @@ void *new_sess(int size, int fd, cb_fn cb, void *arg)
 	DBG(0, "alloc failed\n");
 	return NULL;
     }
+    s->app = __me.app;
     s->cb = cb;
     s->arg = arg;
     s->fd = fd;
     s->next = __me.tmp_sess;
+    if (s->next)
+	s->next->pprev = &s->next;
+    s->pprev = &__me.tmp_sess;
     __me.tmp_sess = s;
     return s;
 }
 
+int sess_watch(struct sess *s, int fd, int events)
+{
+#ifdef USE_EPOLL
+    struct epoll_event ev = { .events = 0, .data.ptr = s };
+    int ret;
+#endif
+
+    if (fd < 0)
+	return -1;
+    if (s && fd == s->fd) {
+	if (events == s->events)
+	    return 0;	/* unchanged */
+	s->events = events;
+    }
+#ifdef USE_EPOLL
+    if (events == 0) {
+	epoll_ctl(__me.pollfd, EPOLL_CTL_DEL, fd, &ev);
+	return 0;
+    }
+    if (events & SE_READ)
+	ev.events |= EPOLLIN;
+    if (events & SE_WRITE)
+	ev.events |= EPOLLOUT;
+    ret = epoll_ctl(__me.pollfd, EPOLL_CTL_MOD, fd, &ev);
+    if (ret && errno == ENOENT)
+	ret = epoll_ctl(__me.pollfd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret)
+	DBG(0, "epoll_ctl on fd %d failed, errno %d\n", fd, errno);
+    return ret;
+#else
+    if (fd >= FD_SETSIZE) {
+	DBG(0, "fd %d beyond FD_SETSIZE\n", fd);
+	return -1;
+    }
+    watch[fd].s = events ? s : NULL;
+    watch[fd].events = events;
+    if (events && fd > watch_max)
+	watch_max = fd;
+    while (watch_max >= 0 && !watch[watch_max].events)
+	watch_max--;
+    return 0;
+#endif
+}
+
+/*
+ * Record events for a session, and put it in the ready list if
+ * not there yet.
+ */
+void sess_ready(struct sess *s, int events)
+{
+    if (!s->revents) {
+	s->next_ready = __me.ready;
+	__me.ready = s;
+    }
+    s->revents |= events;
+}
+
+/* wait for events or a timeout (in ms), and fill the ready list */
+static int poll_events(struct my_args *me, int ms)
+{
+    int i, n;
+#ifdef USE_EPOLL
+    struct epoll_event ev[MAX_EVENTS];
+
+    if (me->ready)	/* pending wakeups, do not block */
+	ms = 0;
+    n = epoll_wait(me->pollfd, ev, MAX_EVENTS, ms);
+    for (i = 0; i < n; i++) {
+	int e = 0;
+	if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	    e |= SE_READ;
+	if (ev[i].events & EPOLLOUT)
+	    e |= SE_WRITE;
+	sess_ready(ev[i].data.ptr, e);
+    }
+#else
+    fd_set r, w;
+    struct timeval due;
+
+    FD_ZERO(&r);
+    FD_ZERO(&w);
+    for (i = 0; i <= watch_max; i++) {
+	if (watch[i].events & SE_READ)
+	    FD_SET(i, &r);
+	if (watch[i].events & SE_WRITE)
+	    FD_SET(i, &w);
+    }
+    if (me->ready)
+	ms = 0;
+    due.tv_sec = ms / 1000;
+    due.tv_usec = (ms % 1000) * 1000;
+    n = select(watch_max + 1, &r, &w, NULL, &due);
+    for (i = 0; n > 0 && i <= watch_max; i++) {
+	int e = (FD_ISSET(i, &r) ? SE_READ : 0) |
+		(FD_ISSET(i, &w) ? SE_WRITE : 0);
+	if (e && watch[i].s)
+	    sess_ready(watch[i].s, e);
+    }
+#endif
+    return n;
+}
+
+static void sig_dispatch(int sig)
+{
+    uint64_t t0;
+
+    if (sig > 0 && sig < NSIG && sig_table[sig].fn) {
+	t0 = now_us();
+	sig_table[sig].fn(sig, sig_table[sig].arg);
+	prof_add(&__me.prof.signals, now_us() - t0);
+    }
+}
+
+#ifndef USE_SIGNALFD
+/* async handler, only forwards the signal number to the loop */
+static void sig_catch(int sig)
+{
+    int e = errno;
+    unsigned char c = sig;
+
+    write(sig_pipe[1], &c, 1);
+    errno = e;
+}
+#endif
+
+/* callback for the session that delivers signals */
+static int handle_signals(void *_s, struct cb_args *a)
+{
+    struct sess *s = _s;
+    int i, n;
+#ifdef USE_SIGNALFD
+    struct signalfd_siginfo si[8];
+
+    while ( (n = read(s->fd, si, sizeof(si))) > 0) {
+	for (i = 0; i < n / sizeof(si[0]); i++)
+	    sig_dispatch(si[i].ssi_signo);
+    }
+#else
+    unsigned char c[16];
+
+    while ( (n = read(s->fd, c, sizeof(c))) > 0) {
+	for (i = 0; i < n; i++)
+	    sig_dispatch(c[i]);
+    }
+#endif
+    return 0;
+}
+
+int sig_handle(int sig, void (*fn)(int sig, void *arg), void *arg)
+{
+    struct my_args *me = &__me;
+    sigset_t one;
+    int fd;
+
+    if (sig <= 0 || sig >= NSIG)
+	return -1;
+    if (me->sigsess == NULL) {	/* first call, create the session */
+#ifdef USE_SIGNALFD
+	sigemptyset(&me->sigmask);
+	fd = signalfd(-1, &me->sigmask, 0);
+#else
+	fd = pipe(sig_pipe) ? -1 : sig_pipe[0];
+	if (fd >= 0) {
+	    fcntl(sig_pipe[1], F_SETFL, O_NONBLOCK);
+	    fcntl(sig_pipe[1], F_SETFD, 1 );	// close on exec
+	}
+#endif
+	if (fd < 0) {
+	    perror("cannot create signal descriptor");
+	    return -1;
+	}
+	fcntl(fd, F_SETFD, 1 );	// close on exec
+	me->sigsess = new_sess(sizeof(struct sess), fd, handle_signals, NULL);
+	if (me->sigsess == NULL)
+	    return -1;
+	me->sigsess->app = NULL;
+	sess_watch(me->sigsess, fd, SE_READ);
+    }
+    sig_table[sig].fn = fn;
+    sig_table[sig].arg = arg;
+    sigemptyset(&one);
+    sigaddset(&one, sig);
+#ifdef USE_SIGNALFD
+    if (fn) {
+	sigaddset(&me->sigmask, sig);
+	sigprocmask(SIG_BLOCK, &one, NULL);
+	signalfd(me->sigsess->fd, &me->sigmask, 0);
+    } else {
+	sigdelset(&me->sigmask, sig);
+	signalfd(me->sigsess->fd, &me->sigmask, 0);
+	if (!sigismember(&me->sigmask_orig, sig))
+	    sigprocmask(SIG_UNBLOCK, &one, NULL);
+    }
+#else
+    signal(sig, fn ? sig_catch : SIG_DFL);
+#endif
+    return 0;
+}
+
+/* restore the signal mask in a forked child */
+void sig_reset(void)
+{
+    sigprocmask(SIG_SETMASK, &__me.sigmask_orig, NULL);
+}
+
+/* SIGCHLD handler, reap children and notify the watchers */
+static void sig_chld(int sig, void *arg)
+{
+    struct child_watch *w, **pw;
+    int pid, status;
+
+    while ( (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	for (pw = &__me.children; (w = *pw); pw = &w->next) {
+	    if (w->pid == pid)
+		break;
+	}
+	if (w == NULL) {
+	    DBG(1, "child %d terminated, status 0x%x\n", pid, status);
+	    continue;
+	}
+	*pw = w->next;	/* unlink before the callback */
+	w->next = NULL;
+	DBG(1, "child %d terminated, status 0x%x\n", pid, status);
+	w->fn(w->arg, status);
+    }
+}
+
+void child_watch(struct child_watch *w)
+{
+    w->next = __me.children;
+    __me.children = w;
+}
+
+void child_unwatch(struct child_watch *w)
+{
+    struct child_watch **pw;
+
+    for (pw = &__me.children; *pw; pw = &(*pw)->next) {
+	if (*pw == w) {
+	    *pw = w->next;
+	    w->next = NULL;
+	    return;
+	}
+    }
+}
+
+/*
+ * Run a shell command and wait for it. Unlike system(3) the child
+ * gets the original signal mask, and other children terminating
+ * meanwhile are reported later through SIGCHLD.
+ */
+int sess_system(const char *cmd)
+{
+    int pid, status;
+
+    pid = fork();
+    if (pid < 0)
+	return -1;
+    if (pid == 0) {
+	sig_reset();
+	execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+	_exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+	if (errno != EINTR)
+	    return -1;
+    }
+    return status;
+}
+
+/* why a session is called, one of PW_* */
+static int sess_cause(struct my_args *me, struct sess *s)
+{
+    if (s == me->sigsess)
+	return PW_SIGNAL;
+    return (s->revents & (SE_READ | SE_WRITE)) ? PW_FD : PW_READY;
+}
+
+/*
+ * Call the handler, unlink the session if dying.
+ * The time spent is charged to the session, its app and the loop.
+ */
+static void sess_run(struct my_args *me, struct sess *s, struct cb_args *a)
+{
+    struct sess *next = s->next, **pprev = s->pprev;
+    struct app *app = s->app;
+    int cause = sess_cause(me, s), dead;
+    uint64_t t0, dt;
+
+    DBG(2, "handle session %p\n", s);
+    me->cur = s;
+    me->app = app;
+    a->revents = s->revents;
+    s->revents = 0;
+    t0 = now_us();
+    dead = s->cb(s, a);
+    dt = now_us() - t0;
+    prof_add(&me->prof.run, dt);
+    if (app) {
+	prof_add(&app->prof.run, dt);
+	app->prof.wakeups[cause]++;
+    }
+    if (dead) {	/* session dead, s is gone, unlink */
+	*pprev = next;
+	if (next)
+	    next->pprev = pprev;
+    } else {
+	prof_add(&s->prof.run, dt);
+	s->prof.wakeups[cause]++;
+    }
+}
+
 /*
  * Main loop implementing connection handling
  */
 int mainloop(struct my_args *me)
 {
-
+    me->prof.start = now_us();
     for (;;) {
-	int n;
-	struct sess *s, *nexts, **ps;
-	fd_set r, w;
-	struct cb_args a = {
-		.maxfd = 0,
-		.r = &r, .w = &w,
-		.run = 0 /* prepare select */
-	};
-
-	FD_ZERO(&r);
-	FD_ZERO(&w);
-	gettimeofday(&a.now, NULL);
-	a.due = a.now;
-	a.due.tv_sec += 1000;
-	/* prepare for select */
+	int i, n, ms, causes;
+	struct sess *s, *nexts;
+	struct cb_args a;
+	uint64_t t0;
+
 	if (me->tmp_sess) {
 	    for (n = 1, s = me->tmp_sess; s->next; s = s->next)
 		n++;
 	    DBG(2, "merging %d new sessions\n", n);
 	    s->next = me->sess;
+	    if (me->sess)
+		me->sess->pprev = &s->next;
 	    me->sess = me->tmp_sess;
+	    me->sess->pprev = &me->sess;
 	    me->tmp_sess = NULL;
 	}
-	for (n = 0, s = me->sess; s; s = s->next) {
-	    n++;
-	    me->cur = s;
-	    me->app = s->app;
-	    if (s->cb(s, &a) && a.maxfd < s->fd)
-		a.maxfd = s->fd;
-	}
-	gettimeofday(&a.now, NULL);
-	a.due.tv_sec -= a.now.tv_sec;
-	a.due.tv_usec -= a.now.tv_usec;
-	if (a.due.tv_usec < 0) {
-		a.due.tv_usec += 1000000;
-		a.due.tv_sec--;
-	}
-	if (a.due.tv_sec > 100)
-		a.due.tv_sec = 100;
-	if (a.due.tv_sec < 0)
-		a.due.tv_sec = a.due.tv_usec = 0;
-	DBG(2, "%d sessions due in %d.%06d\n", n, (int)a.due.tv_sec,  (int)a.due.tv_usec);
-	n = select(a.maxfd + 1, &r, &w, NULL, &a.due);
-	gettimeofday(&a.now, NULL);
+	/* sleep at most 100s, as we used to */
+	ms = timer_next(me, now_ms(), 100000);
+	DBG(2, "%d timers, next due in %d ms\n", me->ntimers, ms);
+	t0 = now_us();
+	n = poll_events(me, ms);
+	prof_add(&me->prof.wait, now_us() - t0);
 	if (n <= 0) {
-	    FD_ZERO(&r);
-	    FD_ZERO(&w);
-	    DBG(2, "select returns %d\n", n);
+	    DBG(2, "poll returns %d\n", n);
 	    /* still call handlers on timeouts and signals */
 	}
-	for (n = 0; wait3(NULL, WNOHANG, NULL) >0; n++) ;
-	if (n)
-		DBG(1, "%d children terminated\n", n);
-	a.run = 1; /* now execute the handlers */
-	for (ps = &me->sess; (s = *ps) ;) {
-	    DBG(2, "handle session %p\n", s);
-	    me->cur = s;
-	    me->app = s->app;
-	    nexts = s->next;
-	    if (s->cb(s, &a))	/* socket dead, unlink */
-		*ps = nexts;
-	    else
-		ps = &s->next;
-		
+	a.now = now_ms();
+	causes = 0;
+	/* detach the ready list, wakeups from handlers go to the next round */
+	for (s = me->ready, me->ready = NULL; s; s = nexts) {
+	    nexts = s->next_ready;
+	    causes |= 1 << sess_cause(me, s);
+	    sess_run(me, s, &a);
+	}
+	if (run_timers(me, a.now))
+	    causes |= 1 << PW_TIMER;
+	if (causes == 0)
+	    causes = 1 << PW_IDLE;
+	me->prof.loops++;
+	for (i = 0; i < PW_MAX; i++) {
+	    if (causes & (1 << i))
+		me->prof.wakeups[i]++;
 	}
     }
     return 0;
@@ -245,9 +847,21 @@ int main(int argc, char *argv[])
 
     memset(&__me, 0, sizeof(__me));
     __me.all_apps = all_apps;
+#ifdef USE_EPOLL
+    /* must exist before the apps start and register descriptors */
+    __me.pollfd = epoll_create(MAX_EVENTS);
+    if (__me.pollfd < 0) {
+	perror("epoll_create");
+	return 1;
+    }
+    fcntl(__me.pollfd, F_SETFD, 1 );	// close on exec
+#endif
+    sigprocmask(SIG_BLOCK, NULL, &__me.sigmask_orig);
+    sig_handle(SIGCHLD, sig_chld, NULL);
+    sig_handle(SIGUSR1, prof_signal, NULL);
     /* main program arguments */
     for (i = 1 ; i < argc; i++) {
-	char *optval, *opt = argv[i];
+	char *opt = argv[i];
 	/* options without arguments */
 	if (!strcmp(opt, "-v") || !strcmp(opt, "--verbose")) {
 	    verbose ++;
@@ -257,7 +871,10 @@ int main(int argc, char *argv[])
 	if (argc < 3)
 	    break;
 	/* options with argument */
-	optval = argv[i+1];
+	if (!strcmp(opt, "--profile") && i + 1 < argc) {
+	    __me.prof_file = argv[++i];
+	    continue;
+	}
 	break;
     }
     for (app = all_apps; (a = *app); app++) {
@@ -43,6 +43,8 @@ destructor, and private data.
 #include <memory.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <signal.h>
 #include <sys/time.h>	/* gettimeofday */
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -57,6 +59,40 @@ extern int verbose;
                         __FUNCTION__, __LINE__, ##__VA_ARGS__); \
         } } while(0)
 
+/*
+ * Loop profiler. Durations are in microseconds and kept in log2
+ * histograms of fixed size: bucket 0 counts samples below 1us,
+ * bucket i those in [2^(i-1), 2^i), the last one everything above.
+ * Each session and each app record the time spent in their callback
+ * and why they were called; the loop records the time blocked
+ * waiting for events, timer and signal handlers, and what woke it up.
+ * prof_dump() reports everything, and runs on SIGUSR1.
+ */
+#define PROF_BUCKETS	24	/* the last one starts at ~4s */
+struct prof_hist {
+	uint32_t count;
+	uint32_t max;	/* us */
+	uint64_t total;	/* us */
+	uint32_t bucket[PROF_BUCKETS];
+};
+
+/* wakeup causes */
+enum { PW_FD, PW_TIMER, PW_SIGNAL, PW_READY, PW_IDLE, PW_MAX };
+
+struct prof {
+	struct prof_hist run;	/* callback duration */
+	uint32_t wakeups[PW_MAX];	/* calls by cause */
+};
+
+struct loop_prof {
+	uint64_t start;	/* us, when the loop started */
+	uint32_t loops;
+	uint32_t wakeups[PW_MAX];	/* iterations by cause */
+	struct prof_hist wait;	/* blocked in poll_events() */
+	struct prof_hist run;	/* all session callbacks */
+	struct prof_hist timers;	/* timer callbacks */
+	struct prof_hist signals;	/* signal handlers */
+};
 
 /*
  * descriptor of an application.
@@ -67,35 +103,53 @@ struct app {
 	int (*start)(void);
 	int (*end)(void);
 	void *data;	/* pointer to private data */
+	const char *name;	/* for reports */
+	struct prof prof;	/* aggregate of its sessions */
+	/* optional, app statistics for prof_dump(). In JSON mode
+	 * it must print one object.
+	 */
+	void (*report)(FILE *f, int json);
 };
 
 /*
- * callback in 'prepare' mode returns 1 if fd active.
- * callback in 'run' mode returns 0 if ok, 1 if dying.
- *	destruction must be done in the callback itself
+ * Sessions declare once, through sess_watch(), the events they want on
+ * their descriptors (SE_READ, SE_WRITE) and update the set only when it
+ * changes. The main loop then calls the callback only for sessions
+ * with ready descriptors or woken up with sess_ready(), and a->revents
+ * reports the events.
+ * Timeouts, signals and child termination are also handled as events,
+ * see below.
+ * The callback returns 0 if ok, 1 if dying.
+ *	destruction must be done in the callback itself, including
+ *	sess_watch(s, fd, 0) on all descriptors registered by the session.
  */
+enum { SE_READ = 1, SE_WRITE = 2, SE_WAKEUP = 4 };
+
 struct cb_args {
-	struct timeval now;
-	struct timeval due;	/* earliest due descriptor */
-	fd_set *r;
-	fd_set *w;
-	int maxfd;
-	int run;	/* 0: prepare select, 1: run */
+	uint64_t now;	/* monotonic time in ms, see now_ms() */
+	int revents;	/* SE_* events for the session */
 };
 
 typedef int (*cb_fn)(void *sess, struct cb_args *a);
 struct sess {
 	struct sess *next;
+	struct sess **pprev;	/* to unlink in constant time */
 	struct app *app;	/* parent application */
 	cb_fn	cb;
 	void *arg;	/* identifier */
 	int fd;
+	int events;	/* interest registered on fd */
+	int revents;	/* pending events, see sess_ready() */
+	struct sess *next_ready;	/* ready list */
+	struct prof prof;	/* callback statistics */
 };
 
 /*
  * All sessions should start with a 'struct sess'
  */
 
+struct timer;
+
 /*
  * my_args contains all the arguments for the program
  * The current app is me->app
@@ -107,6 +161,17 @@ struct my_args {
 	struct sess *sess;
 	struct sess *tmp_sess;
 	struct sess *cur;	// session under service
+	struct sess *ready;	// sessions with pending events
+	int pollfd;		// epoll descriptor, if used
+	struct timer **timers;	// heap of armed timers, 1-based
+	int ntimers, timers_size;
+	uint32_t timer_gen;	// expiry pass, see run_timers()
+	struct sess *sigsess;	// delivers signals as events
+	sigset_t sigmask;	// signals handled by sig_handle()
+	sigset_t sigmask_orig;	// mask to restore in children
+	struct child_watch *children;	// see child_watch()
+	struct loop_prof prof;	// loop statistics, see prof_dump()
+	const char *prof_file;	// --profile, JSON dump on SIGUSR1
 	int verbose;	/* allow read all file systems */
 };
 extern struct my_args __me;
@@ -116,16 +181,75 @@ extern struct my_args __me;
  */
 void *new_sess(int size, int fd, cb_fn cb, void *arg);
 
+/*
+ * Register interest for 'events' (SE_READ|SE_WRITE) on fd on behalf
+ * of session s. events == 0 removes the descriptor, and s is then
+ * unused. Calls with unchanged events on s->fd cost nothing.
+ */
+int sess_watch(struct sess *s, int fd, int events);
+/* queue a session for a run-mode call with the given events */
+void sess_ready(struct sess *s, int events);
+
 /*
  * generic socket open routine (general use)
  */
 int opensock(struct sockaddr_in sa, int udp, int client);
-/* add a millisecond value to a timer */
-void timeradd_ms(const struct timeval *src, int ms, struct timeval *dst);
-/* set dst to the min of the two */
-void timersetmin(struct timeval *dst, const struct timeval *cur);
-/* returns true if dst is set and <= 'now' */
-int timerdue(const struct timeval *dst, const struct timeval *now);
+/*
+ * One-shot timers on CLOCK_MONOTONIC, with millisecond resolution.
+ * A timer is normally embedded in the owner's state and zero-filled
+ * or set with timer_init(). timer_arm() (re)starts it, and fn(arg)
+ * is called from the main loop when it expires. Armed timers are kept
+ * in a binary heap so the loop finds the next deadline in O(1).
+ */
+struct timer {
+	uint64_t due;	/* expiry time, ms */
+	int slot;	/* position in the heap, 0 if not armed */
+	uint32_t gen;	/* expiry pass when armed */
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+/* monotonic time in milliseconds, immune to clock changes */
+uint64_t now_ms(void);
+void timer_init(struct timer *t, void (*fn)(void *), void *arg);
+/* arm (or re-arm) the timer to expire in 'ms' milliseconds */
+int timer_arm(struct timer *t, int ms);
+void timer_cancel(struct timer *t);
+static inline int timer_pending(const struct timer *t)
+{
+	return t->slot != 0;
+}
+
+/*
+ * Signals. sig_handle() arranges for fn(sig, arg) to be called from
+ * the main loop when 'sig' arrives; fn == NULL restores the default.
+ * On linux the signals are blocked and read from a signalfd, so
+ * forked children must call sig_reset() before exec.
+ */
+int sig_handle(int sig, void (*fn)(int sig, void *arg), void *arg);
+void sig_reset(void);
+
+/*
+ * Children. Once registered with child_watch(), w->fn(w->arg, status)
+ * is called when the process w->pid terminates. The reaping is driven
+ * by SIGCHLD so nothing is done while no child exits.
+ */
+struct child_watch {
+	struct child_watch *next;
+	int pid;
+	void (*fn)(void *arg, int status);
+	void *arg;
+};
+void child_watch(struct child_watch *w);
+void child_unwatch(struct child_watch *w);
+/* system(3) for a process where SIGCHLD is handled by the loop */
+int sess_system(const char *cmd);
+
+/* print the statistics as text, or JSON if json != 0 */
+void prof_dump(FILE *f, int json);
+
+/* cp437 code for the unicode char u, '?' if none (cp437.c) */
+int cp437_code(uint32_t u);
 
 /*extern struct app;*/
 #endif /* _MYTS_H_ */
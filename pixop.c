@@ -58,15 +58,156 @@ int pix_fill(pixmap_t* dst, int bx, int by, int width, int height, int color)
 	return width*height;		// num of pixels actually filled
 }
 
+/*
+ * Blit kernels. Each one handles a (src bpp, dst bpp) pair with the
+ * first pixel at the start of a byte in both pixmaps, and works on
+ * whole source bytes (or words) per step. The few pixels left at
+ * the end of a row go through get_px()/put_px().
+ * As in the generic code, the sample on the left is on the LSbits
+ * of a byte, and samples are scaled to the destination depth.
+ */
+struct blt_args {
+	uint8_t *dstp;
+	const uint8_t *srcp;
+	int dst_stride, src_stride;
+	int width, height;
+	int bg;
+};
+
+static inline int get_px(const uint8_t *p, int x, int bpp)
+{
+	int b = x * bpp;
+
+	return (p[b / 8] >> (b % 8)) & ((1 << bpp) - 1);
+}
+
+static inline void put_px(uint8_t *p, int x, int bpp, int v)
+{
+	int b = x * bpp, m = ((1 << bpp) - 1) << (b % 8);
+
+	p[b / 8] = (p[b / 8] & ~m) | ((v << (b % 8)) & m);
+}
+
+static inline uint32_t ld32(const uint8_t *p)
+{
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline void st32(uint8_t *p, uint32_t x)
+{
+	memcpy(p, &x, sizeof(x));
+}
+
+/* bg as the generic code uses it, in every pixel of a word */
+static inline uint32_t bg_word(int bg, int bpp)
+{
+	uint32_t mask = (1u << bpp) - 1;
+
+	return (bg & mask) * (0xffffffffu / mask);
+}
+
+/* same depth, up to 8 bpp: copy and OR bg a word at a time */
+static void blt_same(struct blt_args *a, int bpp)
+{
+	int i, j, ppb = 8 / bpp;	/* pixels per byte */
+	int n = a->width / ppb, tail = a->width % ppb;
+	uint32_t bg4 = bg_word(a->bg, bpp);
+	int mask = (1 << bpp) - 1;
+
+	for (i = 0; i < a->height; i++) {
+		uint8_t *dp = a->dstp + i * a->dst_stride;
+		const uint8_t *sp = a->srcp + i * a->src_stride;
+
+		for (j = 0; j + 4 <= n; j += 4)
+			st32(dp + j, ld32(sp + j) | bg4);
+		for (; j < n; j++)
+			dp[j] = sp[j] | (uint8_t)bg4;
+		for (j = 0; j < tail; j++)
+			put_px(dp + n, j, bpp,
+				(get_px(sp + n, j, bpp) | a->bg) & mask);
+	}
+}
+
+/* 4 -> 8 bpp, one source byte gives two destination bytes */
+static void blt_4_8(struct blt_args *a)
+{
+	int i, j, n = a->width / 2;
+
+	for (i = 0; i < a->height; i++) {
+		uint8_t *dp = a->dstp + i * a->dst_stride;
+		const uint8_t *sp = a->srcp + i * a->src_stride;
+
+		for (j = 0; j < n; j++, dp += 2) {
+			dp[0] = (sp[j] & 0xf) * 17 | a->bg;
+			dp[1] = (sp[j] >> 4) * 17 | a->bg;
+		}
+		if (a->width & 1)
+			dp[0] = (sp[n] & 0xf) * 17 | a->bg;
+	}
+}
+
+/* 1 -> 4 bpp, one source byte gives four destination bytes */
+static void blt_1_4(struct blt_args *a)
+{
+	static uint32_t expand[256];	/* 8 samples -> 8 nibbles */
+	int i, j, n = a->width / 8;
+	uint32_t bg4 = bg_word(a->bg, 4);
+
+	if (expand[255] == 0) {
+		for (i = 0; i < 256; i++)
+			for (j = 0; j < 8; j++)
+				if (i & (1 << j))
+					expand[i] |= 0xfu << (4 * j);
+	}
+	for (i = 0; i < a->height; i++) {
+		uint8_t *dp = a->dstp + i * a->dst_stride;
+		const uint8_t *sp = a->srcp + i * a->src_stride;
+
+		for (j = 0; j < n; j++, dp += 4) {
+			uint32_t x = expand[sp[j]] | bg4;
+			/* byte order of the samples, not of the cpu */
+			dp[0] = x;
+			dp[1] = x >> 8;
+			dp[2] = x >> 16;
+			dp[3] = x >> 24;
+		}
+		for (j = 0; j < a->width % 8; j++)
+			put_px(dp, j, 4,
+				(get_px(sp + n, j, 1) * 0xf | a->bg) & 0xf);
+	}
+}
+
+/* 4 -> 32 bpp, each sample replicated in all nibbles of a word */
+static void blt_4_32(struct blt_args *a)
+{
+	int i, j;
+
+	for (i = 0; i < a->height; i++) {
+		uint8_t *dp = a->dstp + i * a->dst_stride;
+		const uint8_t *sp = a->srcp + i * a->src_stride;
+
+		for (j = 0; j < a->width; j++, dp += 4) {
+			int x = (sp[j / 2] >> (4 * (j & 1))) & 0xf;
+
+			st32(dp, x * 0x11111111u | a->bg);
+		}
+	}
+}
+
 /* transfer pixmap "src:sx,sy (width:height)" to pixmap "dst: dx, dy"
- * bg, if non-zero, is OR-ed to every byte in the dst region.
+ * bg, if non-zero, is OR-ed to every pixel in the dst region,
+ * masked to the dst depth.
  */
 int pix_blt(pixmap_t* dst, int dx, int dy,
 	pixmap_t* src, int sx, int sy, int width, int height, int bg)
 {
 	unsigned char *dstp, *srcp;
 	int dst_stride, src_stride;
-	int i, j, n_bytes;
+	int i, j;
+	struct blt_args a;
 
 	if (dst == NULL || src == NULL)
 		return 0;
@@ -108,13 +249,43 @@ int pix_blt(pixmap_t* dst, int dx, int dy,
 	dst_stride = (dst->width*dst->bpp + 7)/8;	// dst width in bytes
 	src_stride = (src->width*src->bpp + 7)/8;	// src width in bytes
 
-	if (0 && dst->bpp == src->bpp) {
-	    for (i = 8, j=1; i > 0; i >>= 1, j <<=1) {
-		if (dst->bpp == i && dx % j == 0 && sx % j == 0)
-			goto fast;
-	    }
+	/* base positions in bytes */
+	dstp = dst->surface + dy*dst_stride + dx*dst->bpp/8;
+	srcp = src->surface + sy*src_stride + sx*src->bpp/8;
+
+	/* use a kernel if both ends start on a byte */
+	a.dstp = dstp;
+	a.srcp = srcp;
+	a.dst_stride = dst_stride;
+	a.src_stride = src_stride;
+	a.width = width;
+	a.height = height;
+	a.bg = bg & 0xff;
+	if ((dx*dst->bpp) % 8 == 0 && (sx*src->bpp) % 8 == 0) {
+		switch (src->bpp << 8 | dst->bpp) {
+		case 1 << 8 | 1:
+		case 2 << 8 | 2:
+		case 4 << 8 | 4:
+		case 8 << 8 | 8:
+			blt_same(&a, dst->bpp);
+			return width*height;
+		case 4 << 8 | 8:
+			blt_4_8(&a);
+			return width*height;
+		case 1 << 8 | 4:
+			blt_1_4(&a);
+			return width*height;
+		case 4 << 8 | 32:
+			blt_4_32(&a);
+			return width*height;
+		}
 	}
-#if 1
+	if (src->bpp > 8 || dst->bpp > 8) {
+		fprintf(stderr, "unsupported pix_blt depth %d -> %d\n",
+			src->bpp, dst->bpp);
+		return 0;
+	}
+
 	/*
 	 * Non optimized code, in case bpp or aligment do not match.
 	 * Assumption: the sample on the left is on the LSbits of a byte.
@@ -125,16 +296,11 @@ int pix_blt(pixmap_t* dst, int dx, int dy,
 	 * The bpp adaptation is done simply by scaling according to
 	 * the difference in max values.
 	 */
-	
-	/* base positions in bytes */
-	dstp = dst->surface + dy*dst_stride + dx*dst->bpp/8;
-	srcp = src->surface + sy*src_stride + sx*src->bpp/8;
-
 	uint16_t srcmask = ( (1<<src->bpp) - 1);
 	uint16_t dstmask = ( (1<<dst->bpp) - 1);
 
 	for (i = 0; i < height; i++) {
-	    uint8_t srcofs = (sx*dst->bpp % 8);
+	    uint8_t srcofs = (sx*src->bpp % 8);
 	    uint8_t dstofs = (dx*dst->bpp % 8);
 	    uint8_t *sp = srcp, *dp = dstp;
 	    uint16_t sd = sp[0] + (sp[1]<<8);
@@ -145,7 +311,7 @@ int pix_blt(pixmap_t* dst, int dx, int dy,
 		if (src->bpp != dst->bpp) /* scale */
 			x = x * ( (1<<dst->bpp) - 1) / ( (1<<src->bpp) - 1);
 		/* clear destination and update */
-		x |= bg;
+		x = (x | bg) & dstmask;
 		dd &= ~(dstmask << dstofs);
 		dd |=  (x << dstofs);
 		/* advance source */
@@ -170,26 +336,6 @@ int pix_blt(pixmap_t* dst, int dx, int dy,
 	    dstp += dst_stride;
 	    srcp += src_stride;
 	}
-#endif
-
-fast:
-	/* if we get here, data is byte-aligned */
-	dx = dx*dst->bpp/8;	// horz byte offset, truncated
-	sx = sx*src->bpp/8;	// horz byte offset, truncated
-
-	dstp = dst->surface + dy*dst_stride + dx;
-	srcp = src->surface + sy*src_stride + sx;
-	n_bytes = width *dst->bpp/8;	// truncated
-
-	for (i = 0; i < height; i++) {
-		memcpy(dstp, srcp, n_bytes);
-		if (bg) {
-			for (j=0; j< n_bytes; j++)
-				dstp[j] |= bg;
-		}
-		dstp += dst_stride;
-		srcp += src_stride;
-	}
 	return width*height;		// num of pixels transferred
 }
 
@@ -0,0 +1,165 @@
+/*
+ * Check of the pix_blt() kernels, run with 'make test'.
+ *
+ * Each random blit is done once with both ends on a byte, which
+ * uses a kernel, and, when the source depth allows, once more from
+ * a copy of the source shifted by one pixel, which goes through the
+ * generic per-pixel code. Both results must match a model of the
+ * generic code: scale the sample, OR bg, mask to the dst depth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pixop.h"
+
+#define SLACK	8	/* the generic code touches the byte after a row */
+
+static int stride(const pixmap_t *p)
+{
+	return (p->width * p->bpp + 7) / 8;
+}
+
+static pixmap_t *pm_new(int w, int h, int bpp)
+{
+	pixmap_t *p = calloc(1, sizeof(*p));
+	int i, n;
+
+	p->width = w;
+	p->height = h;
+	p->bpp = bpp;
+	n = stride(p) * h + SLACK;
+	p->surface = malloc(n);
+	for (i = 0; i < n; i++)
+		p->surface[i] = random();
+	return p;
+}
+
+static void pm_free(pixmap_t *p)
+{
+	free(p->surface);
+	free(p);
+}
+
+static pixmap_t *pm_dup(const pixmap_t *p)
+{
+	pixmap_t *d = pm_new(p->width, p->height, p->bpp);
+
+	memcpy(d->surface, p->surface, stride(p) * p->height + SLACK);
+	return d;
+}
+
+static uint32_t getp(const pixmap_t *p, int x, int y)
+{
+	const uint8_t *r = p->surface + y * stride(p);
+	uint32_t v;
+	int b = x * p->bpp;
+
+	if (p->bpp == 32) {
+		memcpy(&v, r + 4 * x, 4);
+		return v;
+	}
+	return (r[b / 8] >> (b % 8)) & ((1 << p->bpp) - 1);
+}
+
+static void putp(pixmap_t *p, int x, int y, uint32_t v)
+{
+	uint8_t *r = p->surface + y * stride(p);
+	int b = x * p->bpp, m = ((1 << p->bpp) - 1) << (b % 8);
+
+	if (p->bpp == 32) {
+		memcpy(r + 4 * x, &v, 4);
+		return;
+	}
+	r[b / 8] = (r[b / 8] & ~m) | ((v << (b % 8)) & m);
+}
+
+/* what the generic code does, for any depth */
+static void model(pixmap_t *dst, int dx, int dy,
+	pixmap_t *src, int sx, int sy, int w, int h, int bg)
+{
+	uint64_t smax = (1ull << src->bpp) - 1, dmax = (1ull << dst->bpp) - 1;
+	uint64_t v;
+	int x, y;
+
+	c_truncate(&sx, &w, src->width);
+	c_truncate(&sy, &h, src->height);
+	c_truncate(&dx, &w, dst->width);
+	c_truncate(&dy, &h, dst->height);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			v = getp(src, sx + x, sy + y);
+			if (smax != dmax)
+				v = v * dmax / smax;
+			putp(dst, dx + x, dy + y, (v | bg) & dmax);
+		}
+	}
+}
+
+static int same(const pixmap_t *a, const pixmap_t *b)
+{
+	return !memcmp(a->surface, b->surface, stride(a) * a->height);
+}
+
+/* a random offset in -4..n+3, on a byte for depth bpp */
+static int pick(int n, int bpp)
+{
+	int ppb = bpp < 8 ? 8 / bpp : 1, x = random() % (n + 8) - 4;
+
+	return x - ((x % ppb) + ppb) % ppb;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int depth[][2] = {	/* the pairs with a kernel */
+		{ 1, 1 }, { 2, 2 }, { 4, 4 }, { 8, 8 },
+		{ 4, 8 }, { 1, 4 }, { 4, 32 },
+	};
+	int i, k, n = argc > 1 ? atoi(argv[1]) : 20000;
+	int blits = 0, errors = 0;
+
+	srandom(1);
+	for (i = 0; i < n; i++) {
+		const int *d = depth[i % (sizeof(depth) / sizeof(depth[0]))];
+		int sw = 1 + random() % 70, sh = 1 + random() % 12;
+		int dw = 1 + random() % 90, dh = 1 + random() % 12;
+		pixmap_t *src = pm_new(sw, sh, d[0]);
+		pixmap_t *dst = pm_new(dw, dh, d[1]);
+		pixmap_t *ref = pm_dup(dst), *gen = pm_dup(dst);
+		int sx = pick(sw, d[0]), sy = random() % (sh + 4) - 2;
+		int dx = pick(dw, d[1]), dy = random() % (dh + 4) - 2;
+		int w = random() % (sw + 4), h = random() % (sh + 4);
+		int bg = (i & 1) ? random() & 0xff : 0;
+
+		pix_blt(dst, dx, dy, src, sx, sy, w, h, bg);
+		model(ref, dx, dy, src, sx, sy, w, h, bg);
+		blits++;
+		k = !same(dst, ref);
+		if (d[0] < 8 && d[1] <= 8 && sx >= 0) {
+			/* the same pixels, one to the right: generic code */
+			pixmap_t *s2 = pm_new(sw + 1, sh, d[0]);
+			int x, y;
+
+			for (y = 0; y < sh; y++)
+				for (x = 0; x < sw; x++)
+					putp(s2, x + 1, y, getp(src, x, y));
+			pix_blt(gen, dx, dy, s2, sx + 1, sy, w, h, bg);
+			blits++;
+			k |= !same(gen, ref) << 1;
+			pm_free(s2);
+		}
+		if (k && errors++ < 10)
+			fprintf(stderr, "%d -> %d bpp, %dx%d at %d,%d -> %d,%d"
+				" bg 0x%x: %s differs\n", d[0], d[1], w, h,
+				sx, sy, dx, dy, bg,
+				k == 1 ? "kernel" : k == 2 ? "generic" : "both");
+		pm_free(src);
+		pm_free(dst);
+		pm_free(ref);
+		pm_free(gen);
+	}
+	printf("pixtest: %d blits, %d errors\n", blits, errors);
+	return errors != 0;
+}
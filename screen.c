@@ -14,6 +14,12 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef FB_THREAD
+#include <pthread.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "pixop.h"
 #include "screen.h"
@@ -24,12 +30,150 @@ typedef unsigned char u8 ;
 
 #include "font.h"
 
+/*
+ * Glyph cache. A tile is a char already converted to the depth and
+ * byte layout of the framebuffer, with the background ORed in, so
+ * drawing it at a byte aligned position takes one copy per row.
+ * Tiles are keyed by (font, code, bg), the cursor being part of bg,
+ * are built on first use, and the least recently used one is
+ * recycled when all slots are taken.
+ */
+static void worker_start(fbscreen_t *fb);
+static void worker_stop(fbscreen_t *fb);
+
+#define GLYPH_SLOTS	1024	/* 64 KiB with the 8x16 4bpp font */
+#define GLYPH_HASH	1024	/* buckets, power of 2 */
+
+struct glyph {
+	struct glyph *hnext;	/* hash chain */
+	struct glyph *prev, *next;	/* LRU list, most recent first */
+	const struct font *font;	/* NULL if unused */
+	int code, bg;
+	int size;	/* allocated tile bytes */
+	uint8_t *tile;
+};
+
+struct glyph_cache {
+	struct glyph lru;	/* list head */
+	struct glyph *hash[GLYPH_HASH];
+	struct glyph slot[GLYPH_SLOTS];
+};
+
+static void glyph_free(fbscreen_t *fb)
+{
+	int i;
+
+	if (!fb->glyphs)
+		return;
+	for (i = 0; i < GLYPH_SLOTS; i++)
+		free(fb->glyphs->slot[i].tile);
+	free(fb->glyphs);
+	fb->glyphs = NULL;
+}
+
+static struct glyph_cache *glyph_init(fbscreen_t *fb)
+{
+	struct glyph_cache *gc = calloc(1, sizeof(*gc));
+	int i;
+
+	if (!gc)
+		return NULL;
+	gc->lru.next = gc->lru.prev = &gc->lru;
+	for (i = 0; i < GLYPH_SLOTS; i++) {
+		struct glyph *g = gc->slot + i;
+		g->prev = gc->lru.prev;
+		g->next = &gc->lru;
+		g->prev->next = g;
+		gc->lru.prev = g;
+	}
+	fb->glyphs = gc;
+	return gc;
+}
+
+/* render the tile for g, samples from left to right in each byte LSb */
+static void glyph_build(fbscreen_t *fb, struct glyph *g, int stride)
+{
+	const struct font *f = g->font;
+	pixmap_t src;
+	int x, y, bpp = fb->pixmap.bpp;
+	int src_stride = (f->width * f->bpp + 7)/8;
+	int srcmask = (1 << f->bpp) - 1, dstmask = (1 << bpp) - 1;
+
+	get_char_pixmap(f, g->code, &src);
+	memset(g->tile, 0, stride * f->height);
+	for (y = 0; y < f->height; y++) {
+		const uint8_t *sp = src.surface + y * src_stride;
+		uint8_t *dp = g->tile + y * stride;
+
+		for (x = 0; x < f->width; x++) {
+			int b = x * f->bpp, v = (sp[b / 8] >> (b % 8)) & srcmask;
+
+			if (f->bpp != bpp) /* scale */
+				v = v * dstmask / srcmask;
+			v = (v | g->bg) & dstmask;
+			b = x * bpp;
+			dp[b / 8] |= v << (b % 8);
+		}
+	}
+}
+
+static struct glyph *glyph_get(fbscreen_t *fb, const struct font *f,
+	int code, int bg, int stride)
+{
+	struct glyph_cache *gc = fb->glyphs ? fb->glyphs : glyph_init(fb);
+	struct glyph *g, **pp;
+	uint32_t h = (code | bg << 8) ^ (uint32_t)(uintptr_t)f;
+	int size = stride * f->height;
+
+	if (!gc)
+		return NULL;
+	h = (h * 2654435761u) >> 16 & (GLYPH_HASH - 1);
+	for (g = gc->hash[h]; g; g = g->hnext)
+		if (g->font == f && g->code == code && g->bg == bg)
+			break;
+	if (!g) {	/* recycle the least recently used slot */
+		g = gc->lru.prev;
+		if (g->size < size) {
+			uint8_t *t = realloc(g->tile, size);
+			if (!t)
+				return NULL;
+			g->tile = t;
+			g->size = size;
+		}
+		if (g->font) {	/* remove from its chain */
+			uint32_t oh = (g->code | g->bg << 8) ^
+				(uint32_t)(uintptr_t)g->font;
+
+			oh = (oh * 2654435761u) >> 16 & (GLYPH_HASH - 1);
+			for (pp = &gc->hash[oh]; *pp != g; pp = &(*pp)->hnext)
+				;
+			*pp = g->hnext;
+		}
+		g->font = f;
+		g->code = code;
+		g->bg = bg;
+		g->hnext = gc->hash[h];
+		gc->hash[h] = g;
+		glyph_build(fb, g, stride);
+	}
+	/* move to the front of the LRU list */
+	g->prev->next = g->next;
+	g->next->prev = g->prev;
+	g->next = gc->lru.next;
+	g->prev = &gc->lru;
+	g->next->prev = g;
+	gc->lru.next = g;
+	return g;
+}
+
 fbscreen_t *fb_open(void)
 {
 	struct fb_var_screeninfo vinfo;
 	struct fb_fix_screeninfo finfo;
 	static fbscreen_t fb ; // XXX non reentrant
 
+	worker_stop(&fb);
+	glyph_free(&fb);
 	memset(&fb, 0, sizeof(fb)) ;
 
 	/* Open the file for reading and writing */
@@ -68,6 +212,8 @@ fbscreen_t *fb_open(void)
 	fb.pixmap.height = vinfo.yres ;
 	fb.pixmap.bpp = vinfo.bits_per_pixel;
 	fb.font = &font_pixmap;
+	fb.upd_cost = 16384;	/* about 1/30 of the K3 screen */
+	worker_start(&fb);
 	return &fb;
 }
 
@@ -75,6 +221,7 @@ void fb_close(fbscreen_t *fb)
 {
 	if (!fb)
 		return;
+	worker_stop(fb);	/* it may be using fd */
 	if ((fb->fd != -1) && (fb->pixmap.surface) && (fb->screensize != 0)) {
 		munmap(fb->pixmap.surface, fb->screensize);
 		close(fb->fd);
@@ -84,6 +231,7 @@ void fb_close(fbscreen_t *fb)
 	if (fb->pixmap.surface)
 		memset(&fb->pixmap, 0, sizeof(pixmap_t)) ;
 	fb->pixmap.surface = NULL;
+	glyph_free(fb);
 }
 
 
@@ -112,17 +260,487 @@ void fb_update_area(fbscreen_t *fb,
 	}
 }
 
+static int rect_area(const struct fb_rect *r)
+{
+	return (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void rect_union(struct fb_rect *d, const struct fb_rect *b)
+{
+	if (d->x1 > b->x1)
+		d->x1 = b->x1;
+	if (d->y1 > b->y1)
+		d->y1 = b->y1;
+	if (d->x2 < b->x2)
+		d->x2 = b->x2;
+	if (d->y2 < b->y2)
+		d->y2 = b->y2;
+}
+
+/* pixels saved updating the union of a and b instead of both */
+static int merge_gain(fbscreen_t *fb, const struct fb_rect *a,
+	const struct fb_rect *b)
+{
+	struct fb_rect u = *a;
+
+	rect_union(&u, b);
+	return fb->upd_cost + rect_area(a) + rect_area(b) - rect_area(&u);
+}
+
+void fb_damage(fbscreen_t *fb, int x, int y, int w, int h)
+{
+	struct fb_rect r;
+	int i, best, gain;
+
+	c_truncate(&x, &w, fb->pixmap.width);
+	c_truncate(&y, &h, fb->pixmap.height);
+	if (w == 0 || h == 0)
+		return;
+	r.x1 = x;
+	r.y1 = y;
+	r.x2 = x + w;
+	r.y2 = y + h;
+	for (;;) {	/* absorb queued rectangles while it pays */
+		best = -1;
+		gain = (fb->ndamage == FB_DAMAGE_MAX) ? INT_MIN : -1;
+		for (i = 0; i < fb->ndamage; i++) {
+			int g = merge_gain(fb, &r, &fb->damage[i]);
+			if (g > gain) {
+				gain = g;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		rect_union(&r, &fb->damage[best]);
+		fb->damage[best] = fb->damage[--fb->ndamage];
+	}
+	fb->damage[fb->ndamage++] = r;
+}
+
+/* region of the ghosting grid holding pixel x in a line of len */
+#define GHOST_IDX(x, len)	((x) * FB_GHOST_GRID / (len))
+
+/*
+ * Account a partial update of r. If a region it touches reached
+ * the limit, enlarge r to cover the regions, reset their counters
+ * and return 1 to ask for a full update.
+ */
+static int ghost_check(fbscreen_t *fb, struct fb_rect *r)
+{
+	int W = fb->pixmap.width, H = fb->pixmap.height;
+	int gx1 = GHOST_IDX(r->x1, W), gx2 = GHOST_IDX(r->x2 - 1, W);
+	int gy1 = GHOST_IDX(r->y1, H), gy2 = GHOST_IDX(r->y2 - 1, H);
+	int gx, gy, full = 0;
+
+	if (fb->ghost_limit <= 0)
+		return 0;
+	for (gy = gy1; gy <= gy2; gy++)
+		for (gx = gx1; gx <= gx2; gx++)
+			if (++fb->ghost[gy][gx] > fb->ghost_limit)
+				full = 1;
+	if (!full)
+		return 0;
+	for (gy = gy1; gy <= gy2; gy++)
+		for (gx = gx1; gx <= gx2; gx++)
+			fb->ghost[gy][gx] = 0;
+	r->x1 = gx1 * W / FB_GHOST_GRID;
+	r->x2 = (gx2 + 1) * W / FB_GHOST_GRID;
+	r->y1 = gy1 * H / FB_GHOST_GRID;
+	r->y2 = (gy2 + 1) * H / FB_GHOST_GRID;
+	return 1;
+}
+
+/*
+ * Build the exclusions for an FX update of the queue: the bands
+ * around the bounding box, then the widest horizontal gaps between
+ * queued rectangles. Returns the number of exclusions.
+ */
+static int fx_plan(fbscreen_t *fb, rect_t *ex, struct fb_rect *box)
+{
+	int W = fb->pixmap.width, H = fb->pixmap.height;
+	struct fb_rect bb = fb->damage[0], *d = fb->damage, t;
+	rect_t gap[FB_DAMAGE_MAX];
+	int i, j, n = 0, ngap = 0, end;
+
+	for (i = 1; i < fb->ndamage; i++)
+		rect_union(&bb, &d[i]);
+#define EX(a, b, c, e) do { if ((a) < (c) && (b) < (e)) {	\
+		ex[n].x1 = a; ex[n].y1 = b; ex[n].x2 = c; ex[n].y2 = e;	\
+		n++; } } while (0)
+	EX(0, 0, W, bb.y1);
+	EX(0, bb.y2, W, H);
+	EX(0, bb.y1, bb.x1, bb.y2);
+	EX(bb.x2, bb.y1, W, bb.y2);
+#undef EX
+	/* sort by y1, then collect the uncovered bands */
+	for (i = 1; i < fb->ndamage; i++)
+		for (j = i; j > 0 && d[j].y1 < d[j - 1].y1; j--) {
+			t = d[j];
+			d[j] = d[j - 1];
+			d[j - 1] = t;
+		}
+	for (end = d[0].y2, i = 1; i < fb->ndamage; i++) {
+		if (d[i].y1 > end) {
+			gap[ngap].x1 = bb.x1;
+			gap[ngap].y1 = end;
+			gap[ngap].x2 = bb.x2;
+			gap[ngap].y2 = d[i].y1;
+			ngap++;
+		}
+		if (end < d[i].y2)
+			end = d[i].y2;
+	}
+	/* keep the largest gaps, they are all as wide as the box */
+	while (n < MAX_EXCLUDE_RECTS && ngap > 0) {
+		for (j = 0, i = 1; i < ngap; i++)
+			if (gap[i].y2 - gap[i].y1 > gap[j].y2 - gap[j].y1)
+				j = i;
+		ex[n++] = gap[j];
+		gap[j] = gap[--ngap];
+	}
+	*box = bb;
+	return n;
+}
+
+static int fb_update_fx(fbscreen_t *fb, int mode, rect_t *ex, int n)
+{
+	fx_t fx = INIT_FX_T();
+	int ret;
+
+	fx.update_mode = mode;
+	fx.num_exclude_rects = n;
+	memcpy(fx.exclude_rects, ex, n * sizeof(*ex));
+	ret = ioctl(fb->fd, FBIO_EINK_UPDATE_DISPLAY_FX, &fx);
+	if (ret)
+		fprintf(stderr, "%s %d exclusions error %d\n",
+			__FUNCTION__, n, errno);
+	return ret;
+}
+
+/*
+ * An update for the panel. For FX updates r is the bounding box of
+ * the area not excluded, used to find requests that supersede others.
+ */
+struct fb_req {
+	int fx;	/* FX update, otherwise area */
+	int mode;	/* UMODE_PARTIAL or UMODE_FULL */
+	struct fb_rect r;
+	int nex;	/* exclusions for FX */
+	rect_t ex[MAX_EXCLUDE_RECTS];
+};
+
+/*
+ * Send q to the panel, FX updates only if no_fx is clear. Returns -1
+ * if an FX update failed (it then falls back to the box), the caller
+ * records it in fb->no_fx from the main thread.
+ */
+static int fb_issue(fbscreen_t *fb, struct fb_req *q, int no_fx)
+{
+	struct fb_rect *r = &q->r;
+	int ret = 0;
+
+	if (q->fx && !no_fx) {
+		if (fb_update_fx(fb, q->mode, q->ex, q->nex) == 0)
+			return 0;
+		ret = -1;	/* not supported */
+	}
+	fb_update_area(fb, q->mode, r->x1, r->y1,
+		r->x2 - r->x1, r->y2 - r->y1, NULL);
+	return ret;
+}
+
+#ifdef FB_THREAD
+/*
+ * Display worker. The ioctls may block for hundreds of ms, so the
+ * main loop only queues requests here and the worker issues them,
+ * writing to an eventfd after each one. A new request removes the
+ * queued ones it covers; if the queue is still full it is merged
+ * into the last one. On quit the worker issues what is queued first.
+ */
+#define FB_QUEUE	8
+
+struct fb_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+	int head, count;	/* queued requests */
+	int busy;	/* a request is being issued */
+	int no_fx;	/* an FX update failed, see fb_done() */
+	struct fb_req q[FB_QUEUE];
+};
+
+static int rect_inside(const struct fb_rect *a, const struct fb_rect *b)
+{	/* a inside b */
+	return a->x1 >= b->x1 && a->y1 >= b->y1 &&
+		a->x2 <= b->x2 && a->y2 <= b->y2;
+}
+
+/* does a update everything b updates, as strongly ? */
+static int req_covers(const struct fb_req *a, const struct fb_req *b)
+{
+	int i;
+
+	if (a->mode < b->mode)
+		return 0;
+	if (!a->fx)
+		return rect_inside(&b->r, &a->r);
+	for (i = 0; i < a->nex; i++) {
+		const rect_t *e = &a->ex[i];
+		if (b->r.x1 < e->x2 && e->x1 < b->r.x2 &&
+		    b->r.y1 < e->y2 && e->y1 < b->r.y2)
+			return 0;
+	}
+	return 1;
+}
+
+static void *worker_run(void *arg)
+{
+	fbscreen_t *fb = arg;
+	struct fb_worker *w = fb->worker;
+	struct fb_req q;
+	uint64_t one = 1;
+	int no_fx, ret;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->quit && w->count == 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->count == 0)	/* quit, and nothing left */
+			break;
+		q = w->q[w->head];
+		w->head = (w->head + 1) % FB_QUEUE;
+		w->count--;
+		w->busy = 1;
+		no_fx = w->no_fx;
+		pthread_mutex_unlock(&w->lock);
+		ret = fb_issue(fb, &q, no_fx);
+		pthread_mutex_lock(&w->lock);
+		if (ret)
+			w->no_fx = 1;
+		w->busy = 0;
+		if (write(fb->donefd, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "%s: eventfd write failed\n", __FUNCTION__);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void worker_start(fbscreen_t *fb)
+{
+	struct fb_worker *w = calloc(1, sizeof(*w));
+
+	fb->donefd = -1;
+	if (!w)
+		return;
+	fb->worker = w;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	fb->donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fb->donefd >= 0 && pthread_create(&w->thread, NULL, worker_run, fb) == 0)
+		return;
+	fprintf(stderr, "%s: no display thread, updates are synchronous\n",
+		__FUNCTION__);
+	worker_stop(fb);
+}
+
+static void worker_stop(fbscreen_t *fb)
+{
+	struct fb_worker *w = fb->worker;
+
+	if (!w)
+		return;
+	if (fb->donefd >= 0) {	/* the thread is running */
+		pthread_mutex_lock(&w->lock);
+		w->quit = 1;	/* after what is queued */
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		close(fb->donefd);
+		fb->donefd = -1;
+	}
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+	fb->worker = NULL;
+}
+
+static void fb_submit(fbscreen_t *fb, struct fb_req *q)
+{
+	struct fb_worker *w = fb->worker;
+	int i, n;
+	struct fb_req *last;
+
+	if (!w) {
+		if (fb_issue(fb, q, fb->no_fx))
+			fb->no_fx = 1;
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	/* compact the queue, dropping the requests q covers */
+	for (i = n = 0; i < w->count; i++) {
+		struct fb_req *o = &w->q[(w->head + i) % FB_QUEUE];
+		if (req_covers(q, o))
+			continue;
+		if (n != i)
+			w->q[(w->head + n) % FB_QUEUE] = *o;
+		n++;
+	}
+	w->count = n;
+	if (n == FB_QUEUE) {	/* full, widen the last one */
+		last = &w->q[(w->head + n - 1) % FB_QUEUE];
+		rect_union(&last->r, &q->r);
+		if (last->mode < q->mode)
+			last->mode = q->mode;
+		last->fx = 0;
+	} else {
+		w->q[(w->head + n) % FB_QUEUE] = *q;
+		w->count++;
+	}
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int fb_done(fbscreen_t *fb)
+{
+	struct fb_worker *w = fb->worker;
+	uint64_t n;
+	int pending;
+
+	if (!w)
+		return 0;
+	if (read(fb->donefd, &n, sizeof(n)) < 0)
+		n = 0;	/* nothing completed yet */
+	pthread_mutex_lock(&w->lock);
+	pending = w->count + w->busy;
+	if (w->no_fx)	/* fb_flush() reads it */
+		fb->no_fx = 1;
+	pthread_mutex_unlock(&w->lock);
+	return pending;
+}
+#else /* !FB_THREAD */
+static void worker_start(fbscreen_t *fb)
+{
+	fb->donefd = -1;
+}
+
+static void worker_stop(fbscreen_t *fb)
+{
+}
+
+static void fb_submit(fbscreen_t *fb, struct fb_req *q)
+{
+	if (fb_issue(fb, q, fb->no_fx))
+		fb->no_fx = 1;
+}
+
+int fb_done(fbscreen_t *fb)
+{
+	return 0;
+}
+#endif /* !FB_THREAD */
+
+int fb_flush(fbscreen_t *fb)
+{
+	struct fb_req q;
+	int i, cost, fx_cost, updates = 0;
+
+	/* full updates first, they leave the queue */
+	memset(&q, 0, sizeof(q));
+	for (i = 0; i < fb->ndamage; ) {
+		q.r = fb->damage[i];
+		if (ghost_check(fb, &q.r)) {
+			q.mode = UMODE_FULL;
+			fb_submit(fb, &q);
+			updates++;
+			fb->damage[i] = fb->damage[--fb->ndamage];
+		} else {
+			i++;
+		}
+	}
+	q.mode = UMODE_PARTIAL;
+	if (fb->ndamage > 1 && !fb->no_fx) {
+		cost = 0;
+		for (i = 0; i < fb->ndamage; i++)
+			cost += fb->upd_cost + rect_area(&fb->damage[i]);
+		q.nex = fx_plan(fb, q.ex, &q.r);
+		fx_cost = fb->upd_cost +
+			fb->pixmap.width * fb->pixmap.height;
+		for (i = 0; i < q.nex; i++)
+			fx_cost -= (q.ex[i].x2 - q.ex[i].x1) *
+				(q.ex[i].y2 - q.ex[i].y1);
+		if (fx_cost < cost) {
+			q.fx = 1;
+			fb_submit(fb, &q);
+			fb->ndamage = 0;
+			return updates + 1;
+		}
+		q.nex = 0;
+	}
+	for (i = 0; i < fb->ndamage; i++) {
+		q.r = fb->damage[i];
+		fb_submit(fb, &q);
+		updates++;
+	}
+	fb->ndamage = 0;
+	return updates;
+}
+
 int fb_char_at(fbscreen_t *fb, const struct font *font,
 	int x, int y, char c, int bg)
 {
 	pixmap_t pix;
+	pixmap_t *p = &fb->pixmap;
+	int bpp = p->bpp;
+
 	if (font == NULL)
 		font = fb->font;
+	/* the cache needs whole bytes and a glyph fully on screen */
+	if (bpp <= 8 && (x * bpp) % 8 == 0 && (font->width * bpp) % 8 == 0 &&
+	    x >= 0 && y >= 0 && x + font->width <= p->width &&
+	    y + font->height <= p->height) {
+		int i, stride = font->width * bpp / 8;
+		int dst_stride = (p->width * bpp + 7)/8;
+		struct glyph *g = glyph_get(fb, font,
+			(unsigned char)c, bg & 0xff, stride);
+		uint8_t *dst = p->surface + y * dst_stride + x * bpp / 8;
+
+		if (g) {
+			for (i = 0; i < font->height; i++, dst += dst_stride)
+				memcpy(dst, g->tile + i * stride, stride);
+			return 0;
+		}
+	}
 	get_char_pixmap(font, c, &pix) ;
 	pix_blt(&fb->pixmap, x, y, &pix, 0, 0, -1, -1, bg) ;
 	return 0;
 }
 
+int fb_move(fbscreen_t *fb, int x, int y, int w, int h, int dy)
+{
+	pixmap_t *p = &fb->pixmap;
+	int i, bpp = p->bpp, stride = (p->width * bpp + 7)/8;
+	uint8_t *src, *dst;
+
+	if ((x * bpp) % 8 || (w * bpp) % 8 || x < 0 || y < 0 || w <= 0 ||
+	    h <= 0 || x + w > p->width || y + dy < 0 ||
+	    y + h > p->height || y + dy + h > p->height)
+		return -1;
+	src = p->surface + y * stride + x * bpp / 8;
+	dst = src + dy * stride;
+	if (dy == 0)
+		return 0;
+	if (dy > 0) {	/* bottom up, so we do not copy what we moved */
+		src += (h - 1) * stride;
+		dst += (h - 1) * stride;
+		stride = -stride;
+	}
+	for (i = 0; i < h; i++, src += stride, dst += stride)
+		memcpy(dst, src, w * bpp / 8);
+	return 0;
+}
+
 const struct font *fb_getfont(const char *name)
 {
 	return &font_pixmap;
@@ -19,15 +19,63 @@
 #define UMODE_PARTIAL 0	// 0 XXX full and partial are the same ?
 #define UMODE_FULL 1
 
+/* a rectangle, x2 and y2 excluded */
+struct fb_rect {
+	int x1, y1, x2, y2;
+};
+
+#define FB_DAMAGE_MAX	16	/* queued rectangles */
+#define FB_GHOST_GRID	8	/* regions per side, for ghosting */
+
 typedef struct fbscreen {
 	int fd ;
 	int screensize ;
 	int cur_x, cur_y;	/* for string processing */
 	pixmap_t pixmap ;
 	struct font *font;	/* default font */
+	struct glyph_cache *glyphs;	/* see fb_char_at() */
+
+	/* update scheduler, see fb_damage() */
+	int ndamage;
+	struct fb_rect damage[FB_DAMAGE_MAX];
+	int upd_cost;	/* overhead of one update, in pixels */
+	int ghost_limit;	/* partial updates before a full one, 0 never */
+	int ghost[FB_GHOST_GRID][FB_GHOST_GRID];	/* partial updates */
+	int no_fx;	/* FX updates failed, do not use them (main thread) */
+
+	/* display thread, see fb_done() */
+	int donefd;	/* eventfd, -1 if updates are synchronous */
+	struct fb_worker *worker;
 } fbscreen_t;
 
 fbscreen_t *fb_open(void) ;
 void	fb_close(fbscreen_t *fb) ;
 void	fb_update_area(fbscreen_t *fb, int mode, int x0, int y0, int x1, int y1, void *pbuf) ;
+/*
+ * Update scheduler. fb_damage() queues an area to send to the panel,
+ * merging it with the queued ones when a single update of the union
+ * costs less, counting upd_cost pixels for each update. fb_flush()
+ * sends the queue, using one FX update with exclusions if cheaper
+ * than separate updates. After ghost_limit partial updates touching
+ * a region of the screen, the next one there is a full update.
+ * Returns the number of updates issued.
+ */
+void	fb_damage(fbscreen_t *fb, int x, int y, int w, int h) ;
+int	fb_flush(fbscreen_t *fb) ;
+/*
+ * Built with FB_THREAD, fb_flush() hands the updates to a thread so
+ * the caller never waits for the panel, and donefd becomes readable
+ * when updates complete. fb_done() then clears the event and returns
+ * the number of updates still queued or in progress.
+ * fb_close() waits for them.
+ */
+int	fb_done(fbscreen_t *fb) ;
+/*
+ * move the w x h pixels at x, y down by dy pixels (up if dy < 0),
+ * e.g. to scroll text. x and w must fall on byte boundaries, and the
+ * area stay on screen. Returns -1 if not.
+ */
+int	fb_move(fbscreen_t *fb, int x, int y, int w, int h, int dy) ;
+/* draw c at x, y, ORing bg to the pixels. Uses a cache of glyphs */
+int	fb_char_at(fbscreen_t *fb, const struct font *font, int x, int y, char c, int bg) ;
 #endif
@@ -44,9 +44,102 @@
 #endif
 #include <errno.h>
 #include <ctype.h>      /* isalnum */
+#include <sys/ioctl.h>	/* FIONREAD */
+#include <sys/uio.h>	/* writev */
+#include <regex.h>	/* term_search() */
+#include <stdarg.h>	/* vt_reply() */
+#ifdef TERM_THREADS
+#include <pthread.h>
+#include <poll.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define KEYS_INIT	256	/* keyboard queue, grows up to KEYS_MAX */
+#define KEYS_MAX	262144
+#define REPLY_MAX	64	/* replies to queries, see term_reply() */
+#ifndef TERM_BUFSIZE
+#define TERM_BUFSIZE	65536	/* screen queue */
+#endif
+#define SCREEN_BUDGET	16384	/* bytes read per call of term_screen() */
+#define VT_MAXPARAMS	16	/* parameters in a sequence */
+#define VT_OSC_MAX	64	/* bytes kept from an OSC string */
+#define DRAIN_READS	64	/* max reads after the child is gone */
+#define FLOOD_BACKLOG	1024	/* pty bytes left after a read: flood */
+#define FLOOD_FRAME_MS	250	/* max notification interval in floods */
+#define SYNC_MAX_MS	500	/* longest synchronized update, see sync_held() */
+#define MAX_ROWS	80	/* see term_new() */
+#define MAX_COLS	160
+#define SB_CHUNK	16384	/* scrollback arena */
+#define SB_BLOOM_SHIFT	13	/* log2 of the trigram filter bits */
+#define SB_BLOOM	(1 << SB_BLOOM_SHIFT)
+#define SEARCH_TRI	16	/* trigrams checked by term_search() */
+#define MARKS_MAX	32	/* cells with combining chars */
+
+/*
+ * With TERM_THREADS each terminal has a parser thread which owns the
+ * pty reads and the page, so a flood of output does not delay the
+ * main loop. The parser publishes copies of the page through a triple
+ * buffer: it fills snap[back], then swaps it with snap[mid], and the
+ * loop swaps snap[mid] with snap[front] when SNAP_NEW is set. Neither
+ * side ever waits for the other. A socketpair carries notifications
+ * and replies to queries from the parser, and the stop request from
+ * the loop.
+ * The loop still writes keys to the pty, so it watches the pty only
+ * for SE_WRITE; term_state() reports the front snapshot.
+ */
+#ifdef TERM_THREADS
+#define PTY_EVENTS	0
+#define SNAP_NEW	4	/* flag in 'mid', the index is in the low bits */
+#define PARSE_READS	64	/* reads before publishing a snapshot */
+struct term_snap {
+	int cur;	/* cursor, -1 if hidden */
+	int kflags;
+	term_cell *page;	/* in screen order */
+	uint32_t gen, cur_gen;	/* see page_export() */
+	uint32_t *rowgen;
+	uint32_t hist;	/* scrollback rows so far */
+	int nmarks;
+	struct term_mark marks[MARKS_MAX];
+	struct term_move move;
+};
+#else
+#define PTY_EVENTS	SE_READ
+#endif
+
+/*
+ * Scrollback. Rows leaving the top of the screen are appended to a
+ * ring of SB_CHUNK arenas, each one as
+ *	len, nruns, chars[len], nruns * (count, attr)
+ * where len excludes trailing blanks and the runs cover all columns,
+ * so a line of text takes about 40 bytes. An arena starts with a
+ * bloom filter of the (lowercase) trigrams in its rows, which lets
+ * term_search() skip arenas that cannot match. row[] maps row numbers,
+ * modulo 'lines', to chunk << 16 | offset. Reusing an arena evicts
+ * the rows in it, so memory stays within the budget.
+ * With TERM_THREADS the parser appends and the loop reads, under sb_lock.
+ */
+struct scrollback {
+	int lines;	/* max rows, 0 disables */
+	int nchunks;
+	char **chunk;	/* ring of arenas, allocated on demand */
+	int head, used;	/* arena being filled, bytes used in it */
+	uint32_t *row;	/* 'lines' locators */
+	uint32_t first, next;	/* numbers of the oldest and the next row */
+};
 
-#define KMAX	256	/* keyboard queue */
-#define SMAX	256	/* screen queue */
+/*
+ * The alternate screen, see page_alt(). It holds the page that is
+ * not shown, with its row map and combining chars.
+ */
+struct alt_page {
+	term_cell *page;
+	int *rowmap;
+	struct term_mark marks[MARKS_MAX];
+};
 
 /*
  * flags for terminal emulation.
@@ -68,8 +161,9 @@ enum {
 	kf_wrapped = 0x40,
 };
 /*
- * values used for the 'attribute' page. The low 3 bits are used
- * for foreground color, the next 3 bits are background color.
+ * values used for the attributes, in the top byte of the cells.
+ * The low 3 bits are used for foreground color, the next 3 bits
+ * are background color.
  */
 enum {
 	ka_fg_shift = 0,	/* foreground mask shift */
@@ -85,15 +179,42 @@ struct my_sess {
 	struct sess sess;
 	char *name;     /* session name */
 	int pid;        /* pid of the child */
-	void (*cb)(struct sess *);
+	int status;	/* exit status of the child, -1 if running */
+	struct child_watch child;
+	term_cb cb;
 
-	/* screen/keyboard buf have len *pos. *pos is the next byte to send */
+	/*
+	 * input for the pty, a ring of ksize bytes from keys[khead].
+	 * Allocated on first use, and freed once empty if it grew.
+	 */
 	int kseq;       // need a sequence number for kb input ?
-	int klen;       /* pending input for keyboard */
-	char keys[KMAX];
+	char *keys;
+	int ksize, khead, klen;
 	int kflags;     /* dec mode etc */
-	int slen;       /* pending input for screen */
-	char sbuf[SMAX];
+	char *sbuf;	/* screen input, TERM_BUFSIZE bytes */
+	/* flood handling, see struct term_stats */
+	int flood;	/* the last read left a backlog */
+	int flow;	/* backpressure enabled */
+	volatile int throttled;	/* not reading the pty */
+	uint64_t last_frame;	/* ms, last change notified */
+	int late;	/* a change was held back, see term_frame_due() */
+	struct term_stats stats;
+	/* synchronized output (DEC mode 2026), see sync_held() */
+	int sync;	/* the application is drawing a frame */
+	int frame;	/* a frame ended, not notified yet */
+	uint64_t sync_start;	/* ms */
+	/* escape sequence parser, see page_append() */
+	uint8_t vt_state;
+	char vt_mark;	/* private marker, e.g. '?' */
+	int vt_ninter;	/* intermediate chars */
+	char vt_inter[3];
+	int vt_nparams;
+	int vt_params[VT_MAXPARAMS];
+	int vt_osclen;
+	char vt_osc[VT_OSC_MAX];
+	/* UTF-8 decoder, see utf8_step() */
+	int utf_need;	/* continuation bytes expected */
+	uint32_t utf_cp, utf_min;
 
 	/* store pagelen instead of recomputing it all the times */
 	int rows, cols, pagelen; /* geometry */
@@ -104,612 +225,2541 @@ struct my_sess {
 	 * we store row, i.e. the first line to be left unchanged.
 	 */
 	int scroll_top, scroll_bottom;
-	/* the page is made of rows*cols chars followed by attributes
-	 * with the same layout
+	/* saved by DECSC (ESC 7), restored by DECRC (ESC 8) */
+	int save_cur, save_kflags;
+	uint8_t save_attr;
+	/* the page is made of rows*cols cells, see term_cell.
+	 * Screen rows are mapped to page rows
+	 * through rowmap[] so scrolling only rotates the map, use
+	 * cell() to access the page and page_export() to export it.
 	 */
 	/*
 	 * attributes -- we use bits for foreground and bg color.
 	 */
 	uint8_t		cur_attr;	/* current attributes */
 
-	char *page;     /* dump of the screen */
+	term_cell *page;     /* dump of the screen */
+	int *rowmap;	/* page row for each screen row */
+	/*
+	 * combining chars, by page offset. Entries are stale once the
+	 * cell lost CELL_MARKS, see page_mark().
+	 */
+	int marks_next;	/* entry to reuse */
+	struct term_mark marks[MARKS_MAX];
+	/*
+	 * change tracking, see term_state(). Writes through cell() stamp
+	 * the screen row with the current generation and set 'dirty'.
+	 * The generation advances when the page is exported.
+	 */
+	uint32_t gen;
+	uint32_t cur_gen;	/* last cursor move, seen at export */
+	uint32_t *rowgen;	/* per screen row */
+	int dirty;	/* rows changed since the last export */
+	int exp_cur;	/* cursor at the last export */
+	uint32_t scroll_gen;	/* region already stamped by page_scroll */
+	struct alt_page *alt;	/* allocated on first use */
+	int alt_on;	/* the alternate screen is shown */
+	struct term_move move;	/* rows moved, see move_note() */
+	struct scrollback sb;
+#ifndef TERM_THREADS
+	term_cell *export;	/* page in screen order, see term_state() */
+	int exp_nmarks;
+	struct term_mark exp_marks[MARKS_MAX];
+	uint32_t exp_gen, exp_hist;	/* as reported with the export */
+	struct term_move exp_move;
+	struct timer sync_due;	/* ends a synchronized update */
+	struct timer frame_due;	/* shows a change held back in a flood */
+#endif
+#ifdef TERM_THREADS
+	pthread_t thread;
+	int running;	/* the parser thread exists */
+	int stopping;	/* stop requested */
+	volatile int done;	/* the parser is finished */
+	volatile int notified;	/* notification pending on ctl */
+	int ctl[2];	/* socketpair, [0] for the loop, [1] for the parser */
+	volatile int mid;
+	int back, front;	/* owned by the parser and the loop */
+	struct term_snap snap[3];
+	pthread_mutex_t sb_lock;
+	/* replies from the parser, moved to keys[] by the loop */
+	pthread_mutex_t reply_lock;
+	int rlen;
+	char reply[REPLY_MAX];
+#endif
 };
 
-int term_keyin(struct sess *sess, char *k)
+#ifdef TERM_THREADS
+#define SB_LOCK(sh)	pthread_mutex_lock(&(sh)->sb_lock)
+#define SB_UNLOCK(sh)	pthread_mutex_unlock(&(sh)->sb_lock)
+#else
+#define SB_LOCK(sh)
+#define SB_UNLOCK(sh)
+#endif
+
+/*
+ * The cell at offset 'off' of the screen.
+ * For writing only, the row is marked as changed.
+ */
+static inline term_cell *cell(struct my_sess *sh, int off)
+{
+	int row = off / sh->cols;
+
+	sh->rowgen[row] = sh->gen;
+	sh->dirty = 1;
+	return sh->page + sh->rowmap[row] * sh->cols + off % sh->cols;
+}
+
+static inline int cur_pos(struct my_sess *sh)
+{
+	return (sh->kflags & kf_nocursor) ? -1 : sh->cur;
+}
+
+/* anything to show since the last export ? */
+static int page_changed(struct my_sess *sh)
+{
+	return sh->dirty || cur_pos(sh) != sh->exp_cur;
+}
+
+/*
+ * Copy the cells to dst in screen order, the live combining chars
+ * to marks, and the row generations to rowgen if not NULL.
+ * Then start a new generation, with no rows moved,
+ * so later changes are newer than what was exported.
+ * Returns the number of marks.
+ */
+static int page_export(struct my_sess *sh, term_cell *dst,
+	struct term_mark *marks, uint32_t *rowgen)
+{
+	int i, r, n = 0;
+
+	for (r = 0; r < sh->rows; r++, dst += sh->cols)
+		memcpy(dst, sh->page + sh->rowmap[r] * sh->cols,
+			sh->cols * sizeof(*dst));
+	for (i = 0; i < MARKS_MAX; i++) {
+		const struct term_mark *m = sh->marks + i;
+
+		if (!m->cp[0] || !(sh->page[m->off] & CELL_MARKS))
+			continue;	/* unused or stale */
+		for (r = 0; sh->rowmap[r] != m->off / sh->cols; r++) ;
+		marks[n] = *m;
+		marks[n++].off = r * sh->cols + m->off % sh->cols;
+	}
+	if (rowgen)
+		memcpy(rowgen, sh->rowgen, sh->rows * sizeof(*rowgen));
+	if (cur_pos(sh) != sh->exp_cur) {
+		sh->exp_cur = cur_pos(sh);
+		sh->cur_gen = sh->gen;
+	}
+	sh->dirty = 0;
+	sh->gen++;
+	bzero(&sh->move, sizeof(sh->move));
+	return n;
+}
+
+#ifdef TERM_THREADS
+static void snap_fill(struct my_sess *sh, struct term_snap *b)
+{
+	b->gen = sh->gen;
+	b->move = sh->move;
+	b->nmarks = page_export(sh, b->page, b->marks, b->rowgen);
+	b->cur = sh->exp_cur;
+	b->cur_gen = sh->cur_gen;
+	b->kflags = sh->kflags;
+	b->hist = sh->sb.next;
+}
+
+/* parser side: publish the current page */
+static void snap_publish(struct my_sess *sh)
+{
+	snap_fill(sh, &sh->snap[sh->back]);
+	__sync_synchronize();
+	sh->back = __sync_lock_test_and_set(&sh->mid, sh->back | SNAP_NEW);
+	sh->back &= ~SNAP_NEW;
+}
+
+/* loop side: move to the latest snapshot, if any */
+static struct term_snap *snap_fetch(struct my_sess *sh)
+{
+	if (sh->mid & SNAP_NEW) {
+		sh->front = __sync_lock_test_and_set(&sh->mid, sh->front);
+		sh->front &= ~SNAP_NEW;
+		__sync_synchronize();
+	}
+	return &sh->snap[sh->front];
+}
+
+static int term_kflags(struct my_sess *sh)
+{
+	return snap_fetch(sh)->kflags;
+}
+#else
+static int term_kflags(struct my_sess *sh)
+{
+	return sh->kflags;
+}
+
+static void sync_export(struct my_sess *sh)
+{
+	sh->exp_gen = sh->gen;
+	sh->exp_move = sh->move;
+	sh->exp_hist = sh->sb.next;
+	sh->exp_nmarks = page_export(sh, sh->export, sh->exp_marks, NULL);
+}
+#endif
+
+/*
+ * Synchronized output (DEC mode 2026). Between CSI ? 2026 h and l
+ * the application draws a frame, consumers keep the previous one and
+ * are not notified. The frame is exported when the mode is reset, or
+ * shown as is after SYNC_MAX_MS if the application never does.
+ */
+static int sync_held(struct my_sess *sh)
+{
+	return sh->sync && now_ms() - sh->sync_start < SYNC_MAX_MS;
+}
+
+static void sync_set(struct my_sess *sh, int on)
+{
+	if (on) {
+		if (sh->sync)	/* nested, keep the deadline */
+			return;
+		sh->sync = 1;
+		sh->sync_start = now_ms();
+#ifndef TERM_THREADS
+		timer_arm(&sh->sync_due, SYNC_MAX_MS);
+#endif
+		return;
+	}
+	if (!sh->sync)
+		return;
+	sh->sync = 0;
+#ifndef TERM_THREADS
+	timer_cancel(&sh->sync_due);
+#endif
+	if (!page_changed(sh))
+		return;
+#ifdef TERM_THREADS
+	snap_publish(sh);
+#else
+	sync_export(sh);
+#endif
+	sh->frame = 1;
+}
+
+/* watch the pty for reads unless throttled, for writes if keys */
+static void term_watch(struct my_sess *sh)
+{
+	sess_watch(&sh->sess, sh->sess.fd,
+		(sh->throttled ? 0 : PTY_EVENTS) | (sh->klen ? SE_WRITE : 0));
+}
+
+#ifdef TERM_THREADS
+/* the consumer caught up, let the parser read again */
+static void term_resume(struct my_sess *sh)
+{
+	__sync_synchronize();	/* pairs with term_throttle() */
+	if (sh->throttled && sh->ctl[0] >= 0)
+		write(sh->ctl[0], "r", 1);
+}
+#else
+static void term_resume(struct my_sess *sh)
+{
+	if (sh->throttled && sh->sess.fd >= 0) {
+		sh->throttled = 0;
+		term_watch(sh);
+	}
+}
+#endif
+
+/* make room for 'want' bytes in the ring, up to KEYS_MAX */
+static int keys_grow(struct my_sess *sh, int want)
+{
+	int n, size = sh->ksize ? sh->ksize : KEYS_INIT;
+	char *p;
+
+	while (size < want && size < KEYS_MAX)
+		size *= 2;
+	if (size > KEYS_MAX)
+		size = KEYS_MAX;
+	if (size <= sh->ksize)
+		return -1;
+	p = malloc(size);
+	if (p == NULL)
+		return -1;
+	n = sh->ksize - sh->khead;	/* unwrap the queue */
+	if (n > sh->klen)
+		n = sh->klen;
+	memcpy(p, sh->keys + sh->khead, n);
+	memcpy(p + n, sh->keys, sh->klen - n);
+	free(sh->keys);
+	sh->keys = p;
+	sh->ksize = size;
+	sh->khead = 0;
+	return size < want ? -1 : 0;
+}
+
+/* 0 if len more bytes fit in the queue, growing it if needed */
+static int keys_room(struct my_sess *sh, int len)
+{
+	return len > sh->ksize - sh->klen ? keys_grow(sh, sh->klen + len) : 0;
+}
+
+/* queue len bytes for the pty, returns how many fit */
+static int keys_add(struct my_sess *sh, const char *k, int len)
+{
+	int n, tail;
+
+	if (keys_room(sh, len))
+		len = sh->ksize - sh->klen;
+	if (len <= 0)
+		return 0;
+	tail = sh->khead + sh->klen;
+	if (tail >= sh->ksize)
+		tail -= sh->ksize;
+	n = sh->ksize - tail;	/* room before the end */
+	if (n > len)
+		n = len;
+	memcpy(sh->keys + tail, k, n);
+	memcpy(sh->keys, k + n, len - n);
+	sh->klen += len;
+	term_watch(sh);	/* now we need to know when the pty is writable */
+	return len;
+}
+
+/*
+ * Answer a query from the application, through the keyboard queue.
+ * With TERM_THREADS the parser cannot touch keys[], so it leaves the
+ * reply in reply[] and sends 'k' to the loop, see term_input().
+ * A reply that does not fit is dropped, never cut.
+ */
+#ifdef TERM_THREADS
+static void term_reply(struct my_sess *sh, const char *r, int len)
+{
+	pthread_mutex_lock(&sh->reply_lock);
+	if (len > sizeof(sh->reply) - sh->rlen) {
+		DBG(1, "reply dropped on %s\n", sh->name);
+		len = 0;
+	}
+	memcpy(sh->reply + sh->rlen, r, len);
+	sh->rlen += len;
+	pthread_mutex_unlock(&sh->reply_lock);
+	if (len)
+		write(sh->ctl[1], "k", 1);
+}
+
+/* loop side: move the replies to the keyboard queue */
+static void term_replies(struct my_sess *sh)
+{
+	pthread_mutex_lock(&sh->reply_lock);
+	if (keys_room(sh, sh->rlen))
+		DBG(1, "replies dropped on %s\n", sh->name);
+	else
+		keys_add(sh, sh->reply, sh->rlen);
+	sh->rlen = 0;
+	pthread_mutex_unlock(&sh->reply_lock);
+}
+#else
+static void term_reply(struct my_sess *sh, const char *r, int len)
+{
+	if (keys_room(sh, len))
+		DBG(1, "reply dropped on %s\n", sh->name);
+	else
+		keys_add(sh, r, len);
+}
+#endif
+
+int term_keyin(struct sess *sess, const char *k, int len)
 {
 	struct my_sess *sh = (struct my_sess *)sess;
+	int n = 0;
 
+	if (!sh || sh->sess.fd < 0)
+		return -1;
         /* map arrow keys to DEC in private mode. */
-        if ((sh->kflags & kf_priv) && strlen(k) > 2 &&
-			k[0] == '\033' && k[1] == '[' && index("ABCD", k[2])) {
-		    k[1] = 'O';
+        if ((term_kflags(sh) & kf_priv) && len > 2 &&
+			k[0] == '\033' && k[1] == '[' && k[2] && index("ABCD", k[2])) {
+		    if (keys_room(sh, len))
+			return 0;	/* all or nothing */
+		    n = keys_add(sh, "\033O", 2);
+		    k += 2;
+		    len -= 2;
         }
+	return n + keys_add(sh, k, len);
+}
+
+
+/* return the 'modified' flag.
+ * If ptr is set, clears the modified flag and returns
+ * the info to access the screen area.
+ */
+int term_state(struct sess *sess, struct term_state *ptr)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+	int ret;
+	if (!sh)
+		return 0;
+	ret = sh->modified;
+	DBG(2, "called on %s %s modified %d\n", sh->name,
+		ptr ? "reset" : "keep", ret);
+	if (ptr) {
+		if (ptr->flags & TS_MOD)
+			sh->modified = ptr->modified;
+		else
+			ptr->modified = sh->modified;
+		if (ptr->flags & TS_FLOW)
+			sh->flow = ptr->flow;
+		else
+			ptr->flow = sh->flow;
+		if (!sh->modified || !sh->flow)
+			term_resume(sh);
+		ptr->stats = sh->stats;
+		ptr->stats.keys = sh->klen;
+		if (ptr->flags & TS_CB)
+			sh->cb = ptr->cb;
+		else
+			ptr->cb = sh->cb;
+		if (ptr->flags & TS_NAME)
+			sh->name = ptr->name;
+		else
+			ptr->name = sh->name;
+		ptr->rows = sh->rows;
+		ptr->cols = sh->cols;
+		ptr->pid = sh->pid;
+		ptr->status = sh->status;
+#ifdef TERM_THREADS
+		{
+			struct term_snap *f = snap_fetch(sh);
+			ptr->cur = f->cur;
+			ptr->cells = f->page;
+			ptr->marks = f->marks;
+			ptr->nmarks = f->nmarks;
+			ptr->gen = f->gen;
+			ptr->cur_gen = f->cur_gen;
+			ptr->rowgen = f->rowgen;
+			ptr->hist = f->hist;
+			ptr->move = f->move;
+		}
+#else
+		/* in a frame, or just after one, report the last export */
+		if (!sync_held(sh) && (!sh->frame || page_changed(sh)))
+			sync_export(sh);
+		sh->frame = 0;
+		ptr->gen = sh->exp_gen;
+		ptr->move = sh->exp_move;
+		ptr->cur = sh->exp_cur;
+		ptr->cells = sh->export;
+		ptr->marks = sh->exp_marks;
+		ptr->nmarks = sh->exp_nmarks;
+		ptr->cur_gen = sh->cur_gen;
+		ptr->rowgen = sh->rowgen;
+		ptr->hist = sh->exp_hist;
+#endif
+		SB_LOCK(sh);
+		ptr->hist_rows = (int)(ptr->hist - sh->sb.first);
+		SB_UNLOCK(sh);
+		if (ptr->hist_rows < 0)
+			ptr->hist_rows = 0;
+	}
+	return ret;
+}
+
+/*
+ * After a change next to column col (0..cols) of the row holding
+ * offset 'off', blank the half of a wide char left on either side.
+ */
+static void wide_fix(struct my_sess *sh, int off, int col)
+{
+	term_cell *x = cell(sh, off - off % sh->cols);
+	term_cell l = col > 0 ? x[col - 1] : 0;
+	term_cell r = col < sh->cols ? x[col] : 0;
+
+	if ((l & CELL_WIDE) && !(r & CELL_CONT))
+		x[col - 1] = CELL(' ', CELL_ATTR(l));
+	if ((r & CELL_CONT) && !(l & CELL_WIDE))
+		x[col] = CELL(' ', CELL_ATTR(r));
+}
+
+/* erase part of the 'screen' from 'start' for 'len' cells,
+ * with the current attributes.
+ */
+static void erase(struct my_sess *sh, int start, int len)
+{
+	term_cell *x, c = CELL(' ', sh->cur_attr);
+	int i, n;
+
+	DBG(2, "start %d pagelen %d len %d\n", start, sh->pagelen, len);
+	for (; len > 0; start += n, len -= n) {	/* one row at a time */
+		n = sh->cols - start % sh->cols;
+		if (n > len)
+			n = len;
+		x = cell(sh, start);
+		for (i = 0; i < n; i++)
+			x[i] = c;
+		wide_fix(sh, start, start % sh->cols);
+		wide_fix(sh, start, start % sh->cols + n);
+	}
+}
+
+/* hash of three chars, ignoring case, for the arena filters */
+static inline uint32_t trigram(const uint8_t *p)
+{
+	uint32_t x = tolower(p[0]) << 16 | tolower(p[1]) << 8 | tolower(p[2]);
+
+	return (x * 2654435761u) >> (32 - SB_BLOOM_SHIFT);
+}
+
+/*
+ * UTF-8 support. The parser feeds bytes >= 0x80 to utf8_step(), the
+ * scrollback and the search keep rows as UTF-8 text.
+ */
+static int utf8_put(uint8_t *p, uint32_t c)
+{
+	if (c < 0x80) {
+		p[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		p[0] = 0xc0 | c >> 6;
+		p[1] = 0x80 | (c & 0x3f);
+		return 2;
+	} else if (c < 0x10000) {
+		p[0] = 0xe0 | c >> 12;
+		p[1] = 0x80 | (c >> 6 & 0x3f);
+		p[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	p[0] = 0xf0 | c >> 18;
+	p[1] = 0x80 | (c >> 12 & 0x3f);
+	p[2] = 0x80 | (c >> 6 & 0x3f);
+	p[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* decode text written by utf8_put() */
+static uint32_t utf8_get(const uint8_t **pp)
+{
+	const uint8_t *p = *pp;
+	uint32_t c = *p++;
+	int n = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+
+	c &= 0x7f >> n;
+	while (n--)
+		c = c << 6 | (*p++ & 0x3f);
+	*pp = p;
+	return c;
+}
+
+/* display width of c: 0 for combining chars, 2 for wide ones */
+static int cp_width(uint32_t c)
+{
+	static const uint32_t zero[][2] = {
+		{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+		{ 0x0610, 0x061a }, { 0x064b, 0x065f }, { 0x1ab0, 0x1aff },
+		{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x20d0, 0x20ff },
+		{ 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f } };
+	static const uint32_t wide[][2] = {
+		{ 0x1100, 0x115f }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+		{ 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+		{ 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe30, 0xfe4f },
+		{ 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f },
+		{ 0x1f900, 0x1f9ff }, { 0x20000, 0x3fffd } };
+	int i;
+
+	if (c < 0x300)
+		return 1;
+	for (i = 0; i < sizeof(zero) / sizeof(zero[0]); i++)
+		if (c >= zero[i][0] && c <= zero[i][1])
+			return 0;
+	for (i = 0; i < sizeof(wide) / sizeof(wide[0]); i++)
+		if (c >= wide[i][0] && c <= wide[i][1])
+			return 2;
+	return 1;
+}
+
+/*
+ * Row text as UTF-8 without trailing blanks, skipping CELL_CONT.
+ * colmap[i], if not NULL, is the column of byte i, and colmap[len]
+ * the column after the text. Returns len. text needs 4 * cols bytes.
+ */
+static int row_text(const term_cell *c, int cols, uint8_t *text,
+	uint8_t *colmap)
+{
+	int i, k, n, len = 0;
+
+	while (cols > 0 && (c[cols - 1] & ~CELL(0, 0xff)) == ' ')
+		cols--;
+	for (i = 0; i < cols; i++) {
+		if (c[i] & CELL_CONT)
+			continue;
+		n = utf8_put(text + len, c[i] & CELL_CP);
+		for (k = 0; colmap && k < n; k++)
+			colmap[len + k] = i;
+		len += n;
+	}
+	if (colmap)
+		colmap[len] = cols;
+	return len;
+}
+
+/* append page row 'prow' to the scrollback, as
+ *	len (2 bytes), nruns, text[len], nruns * (count, attr)
+ */
+static void sb_push(struct my_sess *sh, int prow)
+{
+	struct scrollback *sb = &sh->sb;
+	const term_cell *c = sh->page + prow * sh->cols;
+	uint8_t *p, *q;
+	uint32_t *bloom;
+	int i, j, n, len;
+
+	if (sb->lines == 0)
+		return;
+	SB_LOCK(sh);
+	if (sb->used + 3 + 6 * sh->cols > SB_CHUNK) {	/* next arena */
+		sb->head = (sb->head + 1) % sb->nchunks;
+		sb->used = 0;
+		while (sb->first != sb->next &&
+		    sb->row[sb->first % sb->lines] >> 16 == sb->head)
+			sb->first++;
+	}
+	if (!sb->chunk[sb->head])
+		sb->chunk[sb->head] = malloc(SB_CHUNK);
+	if (!sb->chunk[sb->head]) {
+		SB_UNLOCK(sh);
+		return;
+	}
+	bloom = (uint32_t *)sb->chunk[sb->head];
+	if (sb->used == 0) {	/* new arena, the filter comes first */
+		memset(bloom, 0, SB_BLOOM / 8);
+		sb->used = SB_BLOOM / 8;
+	}
+	if (sb->next - sb->first == sb->lines)
+		sb->first++;
+	p = (uint8_t *)sb->chunk[sb->head] + sb->used;
+	len = row_text(c, sh->cols, p + 3, NULL);
+	p[0] = len & 0xff;
+	p[1] = len >> 8;
+	for (i = 0; i + 2 < len; i++) {
+		j = trigram(p + 3 + i);
+		bloom[j >> 5] |= 1u << (j & 31);
+	}
+	q = p + 3 + len;
+	for (n = 0, i = 0; i < sh->cols; n++, i = j) {
+		for (j = i + 1; j < sh->cols &&
+		    CELL_ATTR(c[j]) == CELL_ATTR(c[i]); j++) ;
+		*q++ = j - i;
+		*q++ = CELL_ATTR(c[i]);
+	}
+	p[2] = n;
+	sb->row[sb->next++ % sb->lines] = sb->head << 16 | sb->used;
+	sb->used = q - (uint8_t *)sb->chunk[sb->head];
+	SB_UNLOCK(sh);
+}
+
+static void sb_free(struct scrollback *sb)
+{
+	int i;
+
+	for (i = 0; i < sb->nchunks; i++)
+		free(sb->chunk[i]);
+	free(sb->chunk);
+	free(sb->row);
+	sb->chunk = NULL;
+	sb->row = NULL;
+	sb->lines = sb->nchunks = sb->head = sb->used = 0;
+	sb->first = sb->next;
+}
+
+int term_scrollback(struct sess *sess, int lines, int bytes)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+	struct scrollback *sb = &sh->sb;
+	int ret = 0;
+
+	SB_LOCK(sh);
+	sb_free(sb);
+	if (lines > 0) {
+		sb->nchunks = (bytes - lines * (int)sizeof(*sb->row)) / SB_CHUNK;
+		if (sb->nchunks < 2)
+			sb->nchunks = 2;
+		sb->row = calloc(lines, sizeof(*sb->row));
+		sb->chunk = calloc(sb->nchunks, sizeof(*sb->chunk));
+		sb->lines = lines;
+		if (!sb->row || !sb->chunk) {
+			sb_free(sb);
+			ret = -1;
+		}
+	}
+	SB_UNLOCK(sh);
+	DBG(1, "%s: %d lines in %d chunks\n", sh->name, sb->lines, sb->nchunks);
+	return ret;
+}
+
+/* decode row n into cells, -1 if not kept. Call with sb_lock held. */
+static int sb_row(struct my_sess *sh, uint32_t n, term_cell *cells)
+{
+	struct scrollback *sb = &sh->sb;
+	const uint8_t *p, *q, *end;
+	uint32_t c;
+	int i, x;
+
+	if (n - sb->first >= sb->next - sb->first)	/* not stored */
+		return -1;
+	x = sb->row[n % sb->lines];
+	p = (uint8_t *)sb->chunk[x >> 16] + (x & 0xffff);
+	end = p + 3 + (p[0] | p[1] << 8);
+	for (i = 0, q = p + 3; q < end && i < sh->cols; ) {
+		c = utf8_get(&q);
+		if (cp_width(c) == 2 && i < sh->cols - 1) {
+			cells[i++] = c | CELL_WIDE;
+			c = ' ' | CELL_CONT;
+		}
+		cells[i++] = c;
+	}
+	while (i < sh->cols)
+		cells[i++] = ' ';
+	for (i = 0, q = end; i < p[2]; i++, q += 2)
+		for (x = 0; x < q[0]; x++)
+			*cells++ |= CELL(0, q[1]);
+	return 0;
+}
+
+int term_sb_row(struct sess *sess, uint32_t n, term_cell *cells)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+	int ret;
+
+	SB_LOCK(sh);
+	ret = sb_row(sh, n, cells);
+	SB_UNLOCK(sh);
+	return ret;
+}
+
+/*
+ * Search support. A finder holds the compiled pattern and the
+ * trigrams of a literal that every match contains: the whole pattern
+ * for substrings, the longest plain run for regular expressions
+ * without alternatives or groups.
+ */
+struct finder {
+	const char *pat;
+	int plen, flags;
+	regex_t re;
+	int ntri;
+	uint32_t tri[SEARCH_TRI];
+};
+
+static void finder_literal(struct finder *f, const char *s, int len)
+{
+	int i;
+
+	for (i = 0; i + 2 < len && f->ntri < SEARCH_TRI; i++) {
+		if (s[i] == ' ' || s[i+1] == ' ' || s[i+2] == ' ')
+			continue;	/* trailing blanks are not indexed */
+		f->tri[f->ntri++] = trigram((const uint8_t *)s + i);
+	}
+}
+
+static int finder_init(struct finder *f, const char *pat, int flags)
+{
+	int i, j, start = 0, best = 0, bestlen = 0;
+	const char *e;
 
-        /* silently drop chars in case of overflow */
-        strncat(sh->keys + sh->klen, k, sizeof(sh->keys) - 1 - sh->klen);
-        sh->klen = strlen(sh->keys);
+	bzero(f, sizeof(*f));
+	f->pat = pat;
+	f->plen = strlen(pat);
+	f->flags = flags;
+	if (f->plen == 0)
+		return -1;
+	if (!(flags & TSR_REGEX)) {
+		finder_literal(f, pat, f->plen);
+		return 0;
+	}
+	if (regcomp(&f->re, pat, REG_EXTENDED |
+	    ((flags & TSR_ICASE) ? REG_ICASE : 0)))
+		return -1;
+	if (strpbrk(pat, "|("))
+		return 0;
+	for (i = 0; i <= f->plen; i++) {
+		/* a run ends at a special char, or before an optional one */
+		if (i < f->plen && !index(".[]^$\\*+?{}", pat[i]) &&
+		    !(pat[i+1] && index("*?{", pat[i+1])))
+			continue;
+		if (i - start > bestlen) {
+			best = start;
+			bestlen = i - start;
+		}
+		if (pat[i] == '\\' && pat[i+1]) {	/* skip the escaped char */
+			i++;
+		} else if (pat[i] == '[') {	/* skip the set */
+			j = i + 1 + (pat[i+1] == '^');
+			j += (pat[j] == ']');
+			e = index(pat + j, ']');
+			if (e == NULL)
+				break;
+			i = e - pat;
+		} else if (pat[i] == '{') {
+			e = index(pat + i, '}');
+			if (e == NULL)
+				break;
+			i = e - pat;
+		}
+		start = i + 1;
+	}
+	finder_literal(f, pat + best, bestlen);
 	return 0;
 }
 
-
-/* return the 'modified' flag.
- * If ptr is set, clears the modified flag and returns
- * the info to access the screen area.
+static void finder_free(struct finder *f)
+{
+	if (f->flags & TSR_REGEX)
+		regfree(&f->re);
+}
+
+/* can arena 'chunk' have a match ? */
+static int finder_may_match(struct finder *f, struct scrollback *sb, int chunk)
+{
+	const uint32_t *bloom = (uint32_t *)sb->chunk[chunk];
+	int i;
+
+	for (i = 0; i < f->ntri; i++) {
+		if (!(bloom[f->tri[i] >> 5] & (1u << (f->tri[i] & 31))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Find a match in s[0..len-1], nul terminated, starting at or after
+ * col, or with back before col and as late as possible.
+ * Returns the start and sets *mlen, or -1. Empty matches are ignored.
+ */
+static int finder_run(struct finder *f, const char *s, int len, int col,
+	int back, int *mlen)
+{
+	regmatch_t pm;
+	int i, found = -1;
+
+	if (!(f->flags & TSR_REGEX)) {
+		i = back ? len - f->plen : col;
+		if (back && i >= col)
+			i = col - 1;
+		for (; i >= 0 && i + f->plen <= len; i += back ? -1 : 1) {
+			if ((f->flags & TSR_ICASE) ?
+			    !strncasecmp(s + i, f->pat, f->plen) :
+			    !memcmp(s + i, f->pat, f->plen)) {
+				*mlen = f->plen;
+				return i;
+			}
+		}
+		return -1;
+	}
+	/* forward: the first match from col. back: the last before col */
+	for (i = back ? 0 : col; i <= len; ) {
+		if (regexec(&f->re, s + i, 1, &pm, i ? REG_NOTBOL : 0))
+			break;
+		if (back && i + pm.rm_so >= col)
+			break;
+		if (pm.rm_eo == pm.rm_so) {	/* empty, try further on */
+			i += pm.rm_so + 1;
+			continue;
+		}
+		found = i + pm.rm_so;
+		*mlen = pm.rm_eo - pm.rm_so;
+		if (!back)
+			break;
+		i = found + 1;
+	}
+	return found;
+}
+
+int term_search(struct sess *sess, const struct term_state *st,
+	const char *pat, int flags, uint32_t row, int col,
+	struct term_match *m)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+	struct scrollback *sb = &sh->sb;
+	struct finder f;
+	term_cell cells[MAX_COLS];
+	const term_cell *c;
+	uint8_t text[4 * MAX_COLS + 1], colmap[4 * MAX_COLS + 1];
+	uint32_t first, end = st->hist + st->rows;
+	int back = flags & TSR_BACK, i, len, mlen, ok = 0, chunk = -1, ret = -1;
+	uint32_t skipped = 0;
+
+	if (finder_init(&f, pat, flags))
+		return -1;
+	SB_LOCK(sh);
+	first = st->hist - (uint32_t)st->hist_rows;
+	if (sb->next - sb->first < sb->next - first)	/* evicted since */
+		first = sb->first;
+	if (row < first || row >= end) {	/* outside, start from an end */
+		if (row < first ? back : !back)
+			goto done;
+		row = back ? end - 1 : first;
+		col = back ? st->cols + 1 : 0;
+	}
+	for (;;) {
+		c = cells;
+		if (row >= st->hist) {	/* on the screen */
+			c = st->cells + (row - st->hist) * st->cols;
+		} else {
+			int x = sb->row[row % sb->lines] >> 16;
+
+			if (x != chunk) {
+				chunk = x;
+				ok = finder_may_match(&f, sb, chunk);
+			}
+			skipped += !ok;
+			if (!ok || sb_row(sh, row, cells))
+				c = NULL;
+		}
+		if (c) {	/* search the text, col to byte and back */
+			len = row_text(c, st->cols, text, colmap);
+			text[len] = '\0';
+			for (i = 0; i < len && colmap[i] < col; i++) ;
+			if (i == len && col > colmap[len])
+				i = len + 1;
+			i = finder_run(&f, (char *)text, len, i, back, &mlen);
+			if (i >= 0) {
+				m->row = row;
+				m->col = colmap[i];
+				m->len = colmap[i + mlen] - m->col;
+				ret = 0;
+				break;
+			}
+		}
+		if (row == (back ? first : end - 1))
+			break;
+		row += back ? -1 : 1;
+		col = back ? st->cols + 1 : 0;
+	}
+done:
+	SB_UNLOCK(sh);
+	DBG(2, "'%s' %s, %u rows skipped\n", pat,
+		ret ? "not found" : "found", skipped);
+	finder_free(&f);
+	return ret;
+}
+
+/*
+ * Record a move of rows for term_state(). Moves of the same rows add
+ * up, the first ones win if rows differ: consumers redraw the changed
+ * rows anyway, so the record is only a hint.
+ */
+static void move_note(struct my_sess *sh, int top, int bottom, int n)
+{
+	struct term_move *mv = &sh->move;
+
+	if (mv->n == 0) {
+		mv->top = top;
+		mv->bottom = bottom;
+	} else if (mv->top != top || mv->bottom != bottom) {
+		return;
+	}
+	mv->n += n;
+	if (mv->n >= bottom - top || -mv->n >= bottom - top)
+		mv->n = 0;	/* nothing left to move */
+}
+
+/* scroll up one line, erase last line. Only the row map moves. */
+static void page_scroll(struct my_sess *sh)
+{
+	int *m = sh->rowmap + sh->scroll_top;
+	int i, top = m[0], l = sh->scroll_bottom - sh->scroll_top - 1;
+
+	if (sh->scroll_top == 0 && !sh->alt_on)
+		sb_push(sh, top);
+	memmove(m, m + 1, l * sizeof(*m));
+	m[l] = top;
+	move_note(sh, sh->scroll_top, sh->scroll_bottom, 1);
+	/* a scroll changes all rows, stamp them once per generation */
+	if (sh->scroll_gen != sh->gen) {
+		for (i = sh->scroll_top; i < sh->scroll_bottom; i++)
+			sh->rowgen[i] = sh->gen;
+		sh->scroll_gen = sh->gen;
+	}
+	erase(sh, (sh->scroll_bottom - 1)*sh->cols, sh->cols);
+}
+
+/*
+ * Switch to the alternate screen (on) or back. The other page is
+ * allocated on first use, then the two are swapped, so the primary
+ * screen comes back as it was with no output from the application.
+ * Rows scrolled off the alternate screen do not go to the scrollback.
+ */
+static int page_alt(struct my_sess *sh, int on)
+{
+	struct alt_page *a = sh->alt;
+	struct term_mark marks[MARKS_MAX];
+	term_cell *page;
+	int i, *map;
+
+	if (on == sh->alt_on)
+		return 0;
+	if (a == NULL) {
+		a = malloc(sizeof(*a) + sh->rows * sizeof(int) +
+			sh->pagelen * sizeof(term_cell));
+		if (a == NULL) {
+			DBG(0, "no memory for the alternate screen\n");
+			return -1;
+		}
+		bzero(a->marks, sizeof(a->marks));
+		a->rowmap = (int *)(a + 1);
+		a->page = (term_cell *)(a->rowmap + sh->rows);
+		for (i = 0; i < sh->rows; i++)
+			a->rowmap[i] = i;
+		for (i = 0; i < sh->pagelen; i++)
+			a->page[i] = CELL(' ', 0);
+		sh->alt = a;
+	}
+	page = sh->page;
+	sh->page = a->page;
+	a->page = page;
+	map = sh->rowmap;
+	sh->rowmap = a->rowmap;
+	a->rowmap = map;
+	memcpy(marks, sh->marks, sizeof(marks));
+	memcpy(sh->marks, a->marks, sizeof(marks));
+	memcpy(a->marks, marks, sizeof(marks));
+	sh->alt_on = on;
+	sh->kflags &= ~kf_wrapped;
+	for (i = 0; i < sh->rows; i++)
+		sh->rowgen[i] = sh->gen;
+	sh->dirty = 1;
+	bzero(&sh->move, sizeof(sh->move));	/* nothing moved, all new */
+	return 0;
+}
+
+/*
+ * Move screen rows top..bottom-1 up by n rows (down if n < 0) and
+ * blank the ones left behind, for line inserts, deletes and scrolls
+ * in the scroll region. As in page_scroll() only the row map moves.
+ */
+static void page_move(struct my_sess *sh, int top, int bottom, int n)
+{
+	int *m = sh->rowmap + top, tmp[MAX_ROWS];
+	int i, h = bottom - top, k = n < 0 ? -n : n;
+
+	if (k == 0 || h <= 0)
+		return;
+	if (k > h)
+		k = h;
+	if (n > 0) {	/* the first k rows go to the bottom */
+		memcpy(tmp, m, k * sizeof(*m));
+		memmove(m, m + k, (h - k) * sizeof(*m));
+		memcpy(m + h - k, tmp, k * sizeof(*m));
+	} else {
+		memcpy(tmp, m + h - k, k * sizeof(*m));
+		memmove(m + k, m, (h - k) * sizeof(*m));
+		memcpy(m, tmp, k * sizeof(*m));
+	}
+	for (i = top; i < bottom; i++)
+		sh->rowgen[i] = sh->gen;
+	sh->dirty = 1;
+	move_note(sh, top, bottom, n < 0 ? -k : k);
+	erase(sh, (n > 0 ? bottom - k : top) * sh->cols, k * sh->cols);
+}
+
+/*
+ * Escape sequence parser. This is a state machine after the DEC VT500
+ * model described in http://vt100.net/emu/dec_ansi_parser
+ * vt_table[state][byte] gives the action for the byte and the next
+ * state. The parser state lives in struct my_sess, so sequences split
+ * across reads need no rescan and each byte is looked at once.
+ * Bytes 0x80-0xff are UTF-8, decoded in the ground state, so we have
+ * no C1 controls.
+ */
+enum {	/* states, must fit in 4 bits */
+	VS_GROUND = 0, VS_ESCAPE, VS_ESCAPE_INTER,
+	VS_CSI_ENTRY, VS_CSI_PARAM, VS_CSI_INTER, VS_CSI_IGNORE,
+	VS_DCS_ENTRY, VS_DCS_PARAM, VS_DCS_INTER, VS_DCS_PASS, VS_DCS_IGNORE,
+	VS_OSC, VS_SOS,		/* SOS, PM and APC strings are ignored */
+	VS_MAX
+};
+
+enum {	/* actions */
+	VA_NONE = 0, VA_PRINT, VA_EXECUTE, VA_COLLECT, VA_PARAM,
+	VA_ESC_DISPATCH, VA_CSI_DISPATCH, VA_OSC_PUT,
+};
+
+#define T(a, s)		((a) << 4 | (s))
+/* C0 controls, except the ones valid anywhere */
+#define C0(a, s)	[0x00 ... 0x17] = T(a, s), [0x19] = T(a, s), \
+			[0x1c ... 0x1f] = T(a, s)
+/* must come last in each state, to override ranges */
+#define ANYWHERE	[0x18] = T(VA_EXECUTE, VS_GROUND), \
+			[0x1a] = T(VA_EXECUTE, VS_GROUND), \
+			[0x1b] = T(VA_NONE, VS_ESCAPE)
+
+static const uint8_t vt_table[VS_MAX][256] = {
+    [VS_GROUND] = { C0(VA_EXECUTE, VS_GROUND),
+	[0x20 ... 0xff] = T(VA_PRINT, VS_GROUND), ANYWHERE },
+    [VS_ESCAPE] = { C0(VA_EXECUTE, VS_ESCAPE),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_ESCAPE_INTER),
+	[0x30 ... 0x7e] = T(VA_ESC_DISPATCH, VS_GROUND),
+	['P'] = T(VA_NONE, VS_DCS_ENTRY),
+	['X'] = T(VA_NONE, VS_SOS),
+	['['] = T(VA_NONE, VS_CSI_ENTRY),
+	[']'] = T(VA_NONE, VS_OSC),
+	['^'] = T(VA_NONE, VS_SOS),
+	['_'] = T(VA_NONE, VS_SOS),
+	[0x7f ... 0xff] = T(VA_NONE, VS_ESCAPE), ANYWHERE },
+    [VS_ESCAPE_INTER] = { C0(VA_EXECUTE, VS_ESCAPE_INTER),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_ESCAPE_INTER),
+	[0x30 ... 0x7e] = T(VA_ESC_DISPATCH, VS_GROUND),
+	[0x7f ... 0xff] = T(VA_NONE, VS_ESCAPE_INTER), ANYWHERE },
+    [VS_CSI_ENTRY] = { C0(VA_EXECUTE, VS_CSI_ENTRY),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_CSI_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3a] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3c ... 0x3f] = T(VA_COLLECT, VS_CSI_PARAM),
+	[0x40 ... 0x7e] = T(VA_CSI_DISPATCH, VS_GROUND),
+	[0x7f ... 0xff] = T(VA_NONE, VS_CSI_ENTRY), ANYWHERE },
+    [VS_CSI_PARAM] = { C0(VA_EXECUTE, VS_CSI_PARAM),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_CSI_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3a] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3c ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_CSI_DISPATCH, VS_GROUND),
+	[0x7f ... 0xff] = T(VA_NONE, VS_CSI_PARAM), ANYWHERE },
+    [VS_CSI_INTER] = { C0(VA_EXECUTE, VS_CSI_INTER),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_CSI_INTER),
+	[0x30 ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_CSI_DISPATCH, VS_GROUND),
+	[0x7f ... 0xff] = T(VA_NONE, VS_CSI_INTER), ANYWHERE },
+    [VS_CSI_IGNORE] = { C0(VA_EXECUTE, VS_CSI_IGNORE),
+	[0x20 ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_NONE, VS_GROUND),
+	[0x7f ... 0xff] = T(VA_NONE, VS_CSI_IGNORE), ANYWHERE },
+    [VS_DCS_ENTRY] = { C0(VA_NONE, VS_DCS_ENTRY),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_DCS_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_DCS_PARAM),
+	[0x3a] = T(VA_NONE, VS_DCS_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_DCS_PARAM),
+	[0x3c ... 0x3f] = T(VA_COLLECT, VS_DCS_PARAM),
+	[0x40 ... 0x7e] = T(VA_NONE, VS_DCS_PASS),
+	[0x7f ... 0xff] = T(VA_NONE, VS_DCS_ENTRY), ANYWHERE },
+    [VS_DCS_PARAM] = { C0(VA_NONE, VS_DCS_PARAM),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_DCS_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_DCS_PARAM),
+	[0x3a] = T(VA_NONE, VS_DCS_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_DCS_PARAM),
+	[0x3c ... 0x3f] = T(VA_NONE, VS_DCS_IGNORE),
+	[0x40 ... 0x7e] = T(VA_NONE, VS_DCS_PASS),
+	[0x7f ... 0xff] = T(VA_NONE, VS_DCS_PARAM), ANYWHERE },
+    [VS_DCS_INTER] = { C0(VA_NONE, VS_DCS_INTER),
+	[0x20 ... 0x2f] = T(VA_COLLECT, VS_DCS_INTER),
+	[0x30 ... 0x3f] = T(VA_NONE, VS_DCS_IGNORE),
+	[0x40 ... 0x7e] = T(VA_NONE, VS_DCS_PASS),
+	[0x7f ... 0xff] = T(VA_NONE, VS_DCS_INTER), ANYWHERE },
+    /* DCS payloads are not used, the string is skipped */
+    [VS_DCS_PASS] = { C0(VA_NONE, VS_DCS_PASS),
+	[0x20 ... 0xff] = T(VA_NONE, VS_DCS_PASS), ANYWHERE },
+    [VS_DCS_IGNORE] = { C0(VA_NONE, VS_DCS_IGNORE),
+	[0x20 ... 0xff] = T(VA_NONE, VS_DCS_IGNORE), ANYWHERE },
+    /* xterm also terminates OSC with BEL */
+    [VS_OSC] = { C0(VA_NONE, VS_OSC),
+	[0x07] = T(VA_NONE, VS_GROUND),
+	[0x20 ... 0xff] = T(VA_OSC_PUT, VS_OSC), ANYWHERE },
+    [VS_SOS] = { C0(VA_NONE, VS_SOS),
+	[0x20 ... 0xff] = T(VA_NONE, VS_SOS), ANYWHERE },
+};
+#undef T
+#undef C0
+#undef ANYWHERE
+
+/* parameter i, or def if missing or 0 */
+static int vt_param(struct my_sess *sh, int i, int def)
+{
+	return (i < sh->vt_nparams && sh->vt_params[i]) ?
+		sh->vt_params[i] : def;
+}
+
+/* log an unsupported sequence, intro is "[" for CSI */
+static void vt_unknown(struct my_sess *sh, const char *what,
+	const char *intro, int c)
+{
+	char buf[128];
+	int i, l = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < sh->vt_nparams && l < sizeof(buf) - 8; i++)
+		l += sprintf(buf + l, "%s%d", i ? ";" : "", sh->vt_params[i]);
+	DBG(0, "-- at %4d %s ESC-%s%.1s%s%s%c\n", sh->cur, what, intro,
+		sh->vt_mark ? (char *)&sh->vt_mark : "", buf,
+		sh->vt_ninter ? sh->vt_inter : "", c);
+}
+
+#define B() do {	\
+		if (sh->cur < 0) {	\
+			DBG(0, "cur %d\n", sh->cur); \
+			sh->cur = 0;	\
+		} else if (sh->cur > sh->pagelen) { \
+			DBG(0, "cur %d\n", sh->cur); \
+			sh->cur = sh->pagelen;	\
+		} \
+	} while(0)
+
+/* save (DECSC) and restore (DECRC) the cursor, attributes and charset */
+static void vt_save(struct my_sess *sh)
+{
+	sh->save_cur = sh->cur;
+	sh->save_attr = sh->cur_attr;
+	sh->save_kflags = sh->kflags & (kf_graphics | kf_dographic);
+}
+
+static void vt_restore(struct my_sess *sh)
+{
+	sh->cur = sh->save_cur;
+	sh->cur_attr = sh->save_attr;
+	sh->kflags &= ~(kf_graphics | kf_dographic | kf_wrapped);
+	sh->kflags |= sh->save_kflags;
+}
+
+/*
+ * CSI sequences, dispatched through csi_table[] on the final byte.
+ * Codes are taken from the FreeBSD 'syscons' driver.
+ * see http://en.wikipedia.org/wiki/ANSI_escape_code
+ */
+typedef void (*csi_fn)(struct my_sess *sh, int curcol, int cmd);
+
+static void csi_cuu(struct my_sess *sh, int curcol, int cmd)
+{	/* up, hang at curcol */
+	sh->cur -= sh->cols * vt_param(sh, 0, 1);
+	if (sh->cur < 0)
+		sh->cur = curcol;
+}
+
+static void csi_cud(struct my_sess *sh, int curcol, int cmd)
+{	/* down, hang at curcol */
+	sh->cur += sh->cols * vt_param(sh, 0, 1);
+	if (sh->cur >= sh->pagelen)
+		sh->cur = sh->pagelen -sh->cols + curcol;
+}
+
+static void csi_cuf(struct my_sess *sh, int curcol, int cmd)
+{	/* right */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (a1 >= sh->cols - curcol)
+		a1 = sh->cols - curcol - 1;
+	sh->cur += a1;
+	B();
+}
+
+static void csi_cub(struct my_sess *sh, int curcol, int cmd)
+{	/* left */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (a1 > curcol)
+		a1 = curcol;
+	sh->cur -= a1;
+	B();
+}
+
+static void csi_cha(struct my_sess *sh, int curcol, int cmd)
+{	/* horizontal position absolute */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (a1 > sh->cols)
+		a1 = sh->cols;
+	sh->cur += (a1 -1 ) - curcol;
+	B();
+}
+
+static void csi_cup(struct my_sess *sh, int curcol, int cmd)
+{	/* both H and f are cursor position */
+	int a1 = vt_param(sh, 0, 1), a2 = vt_param(sh, 1, 1);
+
+	DBG(2, "a1 %d a2 %d\n", a1, a2);
+	if (a1 > sh->rows)
+		a1 = sh->rows;
+	if (a2 > sh->cols)
+		a2 = sh->cols;
+	sh->cur = (a1 - 1)*sh->cols + a2 - 1;
+	B();
+}
+
+static void csi_vpa(struct my_sess *sh, int curcol, int cmd)
+{	/* vertical position absolute */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (a1 >= sh->rows)
+		a1 = sh->rows;
+	sh->cur = (a1 - 1)*sh->cols + curcol;
+	B();
+}
+
+static void csi_ignore(struct my_sess *sh, int curcol, int cmd)
+{	/* tab clear */
+}
+
+/* set (h) or reset (l) modes, all parameters are used */
+static void csi_mode(struct my_sess *sh, int curcol, int cmd)
+{
+	int i, on = (cmd == 'h');
+
+	for (i = 0; i < sh->vt_nparams || i == 0; i++) {
+	    int a = vt_param(sh, i, 0);
+	    if (sh->vt_mark == '?') {	/* dec modes */
+		switch (a) {
+		case 1: /* Cursor keys mode. */
+			if (on)
+				sh->kflags |= kf_priv;
+			else
+				sh->kflags &= ~kf_priv;
+			break;
+		case 25: /* Display cursor. */
+			if (on)
+				sh->kflags &= ~kf_nocursor;
+			else
+				sh->kflags |= kf_nocursor;
+			break;
+		case 47: /* Switch to alternate buffer. */
+		case 1047: /* ... clearing it when leaving */
+		case 1049: /* ... saving the cursor, clearing it */
+			if (on && a == 1049)
+				vt_save(sh);
+			if (!on && a == 1047 && sh->alt_on)
+				erase(sh, 0, sh->pagelen);
+			if (page_alt(sh, on))
+				break;
+			if (on && a == 1049)
+				erase(sh, 0, sh->pagelen);
+			if (!on && a == 1049)
+				vt_restore(sh);
+			break;
+		case 2026: /* synchronized output */
+			sync_set(sh, on);
+			break;
+		case 2: /* DECANM: ANSI/VT52 mode. */
+		case 3: /* 132 column mode. */
+		case 5: /* Inverse video. */
+		case 6: /* Origin mode. */
+		case 7: /* Autowrap mode. */
+		case 8: /* Autorepeat mode. */
+		case 12: /* blinking cursor */
+		case 40: /* Allow 132 columns. */
+		case 45: /* Enable reverse wraparound. */
+		default:
+			// e.g. mouse modes, bracketed paste
+			vt_unknown(sh, "unsupported mode", "[", cmd);
+			break;
+		}
+	    } else {
+		switch (a) {
+		case 4: 	/* insert mode */
+			if (on)
+				sh->kflags |= kf_insert;
+			else
+				sh->kflags &= ~kf_insert;
+			break;
+		default:
+			vt_unknown(sh, "unsupported mode", "[", cmd);
+			break;
+		}
+	    }
+	}
+}
+
+static void csi_ed(struct my_sess *sh, int curcol, int cmd)
+{	/* erase display */
+	int a1 = vt_param(sh, 0, 0);
+
+	if (a1 == 1) {	/* erase from top to cursor */
+		erase(sh, 0, sh->cur);
+	} else if (a1 == 2) { /* erase entire page */
+		erase(sh, 0, sh->pagelen);
+		// sh->cur = 0; // XXX msdos ansy.sys
+	} else { /* erase from cursor to bottom */
+		erase(sh, sh->cur, sh->pagelen - sh->cur);
+	}
+}
+
+static void csi_el(struct my_sess *sh, int curcol, int cmd)
+{	/* erase line */
+	int a1 = vt_param(sh, 0, 0);
+
+	if (a1 == 1) { /* from beg. to cursor */
+		erase(sh, sh->cur - curcol, curcol);
+	} else if (a1 == 2) { /* entire line */
+		erase(sh, sh->cur - curcol, sh->cols);
+	} else { /* from cursor to end of line */
+		erase(sh, sh->cur, sh->cols - curcol);
+	}
+}
+
+static void csi_sgr(struct my_sess *sh, int curcol, int cmd)
+{	/* set_graphic_rendition, all parameters are used */
+	int i, a;
+
+	for (i = 0; i < sh->vt_nparams || i == 0; i++) {
+	    a = vt_param(sh, i, 0);
+	    switch(a) {
+	    case 0: /* reset */
+		sh->cur_attr = 0;
+		break;
+	    case 1: /* bold */
+	    case 4: /* underline */
+	    case 5: /* blink */
+	    case 7: /* reverse */
+	    case 22: /* remove bold */
+	    case 24: /* remove underline */
+	    case 25: /* remove blink */
+	    case 27: /* remove reverse */
+		break;	/* right now ignore attributes, fix later */
+	    case 30: /* Set foreground color: black */
+	    case 31: /* Set foreground color: red */
+	    case 32: /* Set foreground color: green */
+	    case 33: /* Set foreground color: brown */
+	    case 34: /* Set foreground color: blue */
+	    case 35: /* Set foreground color: magenta */
+	    case 36: /* Set foreground color: cyan */
+	    case 37: /* Set foreground color: white */
+		DBG(2, "setattr fg %d\n", a);
+		sh->cur_attr &= ~ka_fg;
+		sh->cur_attr |= (37 - a);
+		break;
+	    case 39: /* Set default foreground color. */
+		DBG(2, "setattr fg %d\n", a);
+		sh->cur_attr &= ~ka_fg;
+		break;
+	    case 40: /* Set background color: black */
+	    case 41: /* Set background color: red */
+	    case 42: /* Set background color: green */
+	    case 43: /* Set background color: brown */
+	    case 44: /* Set background color: blue */
+	    case 45: /* Set background color: magenta */
+	    case 46: /* Set background color: cyan */
+	    case 47: /* Set background color: white */
+		DBG(1, "setattr bg %d\n", a);
+		sh->cur_attr &= ~ka_bg;
+		sh->cur_attr |= (47 - a) << ka_bg_shift;
+		break;
+	    case 49: /* Set default background color. */
+		DBG(1, "setattr bg %d\n", a);
+		sh->cur_attr &= ~ka_bg;
+		break;
+	    default:
+		vt_unknown(sh, "unsupported attribute", "[", cmd);
+		break;
+	    }
+	}
+}
+
+static void csi_dch(struct my_sess *sh, int curcol, int cmd)
+{	/* delete n characters */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (curcol + a1 < sh->cols) {
+		term_cell *dst = cell(sh, sh->cur);
+		int l = sh->cols - curcol - a1;
+		memmove(dst, dst + a1, l * sizeof(*dst));
+		wide_fix(sh, sh->cur, curcol);
+		erase(sh, sh->cur + l, a1);
+	} else {
+		erase(sh, sh->cur, sh->cols - curcol);
+	}
+}
+
+static void csi_ich(struct my_sess *sh, int curcol, int cmd)
+{	/* insert n blanks, the rest of the row moves right */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (curcol + a1 < sh->cols) {
+		term_cell *src = cell(sh, sh->cur);
+		memmove(src + a1, src, (sh->cols - curcol - a1) * sizeof(*src));
+		wide_fix(sh, sh->cur, sh->cols);	/* pushed out */
+		erase(sh, sh->cur, a1);
+	} else {
+		erase(sh, sh->cur, sh->cols - curcol);
+	}
+}
+
+static void csi_il(struct my_sess *sh, int curcol, int cmd)
+{	/* insert (L) or delete (M) n lines in the scroll region */
+	int a1 = vt_param(sh, 0, 1), row = sh->cur / sh->cols;
+
+	if (row < sh->scroll_top || row >= sh->scroll_bottom)
+		return;
+	page_move(sh, row, sh->scroll_bottom, cmd == 'L' ? -a1 : a1);
+	sh->cur -= curcol;
+	sh->kflags &= ~kf_wrapped;
+}
+
+static void csi_su(struct my_sess *sh, int curcol, int cmd)
+{	/* scroll the region up (S) or down (T) n lines */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (sh->vt_nparams > 1)	/* CSI T with 5 parameters is mouse */
+		return;
+	if (cmd == 'T') {
+		page_move(sh, sh->scroll_top, sh->scroll_bottom, -a1);
+		return;
+	}
+	if (a1 > sh->scroll_bottom - sh->scroll_top)
+		a1 = sh->scroll_bottom - sh->scroll_top;
+	while (a1-- > 0)	/* like newlines, so rows reach the scrollback */
+		page_scroll(sh);
+}
+
+static void csi_scosc(struct my_sess *sh, int curcol, int cmd)
+{	/* s and u, same as ESC 7 and ESC 8 */
+	if (cmd == 's')
+		vt_save(sh);
+	else
+		vt_restore(sh);
+}
+
+/*
+ * Queries: device attributes (DA), status and cursor position (DSR),
+ * mode state (DECRQM) and the size in chars (XTWINOPS 18). The
+ * answers go to the keyboard queue at once, so applications do not
+ * wait for their timeouts.
+ */
+static void vt_reply(struct my_sess *sh, const char *fmt, ...)
+{
+	char buf[32];
+	va_list ap;
+	int l;
+
+	va_start(ap, fmt);
+	l = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (l > 0 && l < sizeof(buf))
+		term_reply(sh, buf, l);
+}
+
+static void csi_da(struct my_sess *sh, int curcol, int cmd)
+{	/* primary (CSI c) or secondary (CSI > c) attributes */
+	if (vt_param(sh, 0, 0) != 0)
+		return;
+	if (sh->vt_mark == '>')
+		vt_reply(sh, "\033[>1;10;0c");	/* a VT220 */
+	else
+		vt_reply(sh, "\033[?6c");	/* a VT102 */
+}
+
+static void csi_dsr(struct my_sess *sh, int curcol, int cmd)
+{	/* 5: status, 6: cursor position, ?6 also the page */
+	int row = sh->cur / sh->cols;
+
+	if (row >= sh->rows)	/* past the end, scrolls on the next char */
+		row = sh->rows - 1;
+	switch (vt_param(sh, 0, 0)) {
+	case 5:
+		vt_reply(sh, "\033[0n");
+		break;
+	case 6:
+		if (sh->vt_mark == '?')
+			vt_reply(sh, "\033[?%d;%d;1R", row + 1, curcol + 1);
+		else
+			vt_reply(sh, "\033[%d;%dR", row + 1, curcol + 1);
+		break;
+	}
+}
+
+/* DECRQM values: 1 set, 2 reset, 0 unknown, 4 permanently reset */
+static int vt_mode(struct my_sess *sh, int dec, int a)
+{
+	if (!dec)
+		return a != 4 ? 0 : (sh->kflags & kf_insert) ? 1 : 2;
+	switch (a) {
+	case 1:
+		return (sh->kflags & kf_priv) ? 1 : 2;
+	case 7:	/* we do not wrap, see kiterm.ti */
+		return 4;
+	case 25:
+		return (sh->kflags & kf_nocursor) ? 2 : 1;
+	case 47:
+	case 1047:
+	case 1049:
+		return sh->alt_on ? 1 : 2;
+	case 2026:
+		return sh->sync ? 1 : 2;
+	}
+	return 0;
+}
+
+static void csi_decrqm(struct my_sess *sh, int curcol, int cmd)
+{	/* request mode, CSI [?] Ps $ p */
+	int a = vt_param(sh, 0, 0), dec = (sh->vt_mark == '?');
+
+	vt_reply(sh, "\033[%s%d;%d$y", dec ? "?" : "", a, vt_mode(sh, dec, a));
+}
+
+static void csi_winops(struct my_sess *sh, int curcol, int cmd)
+{	/* window operations, we only report the size */
+	if (vt_param(sh, 0, 0) == 18)
+		vt_reply(sh, "\033[8;%d;%dt", sh->rows, sh->cols);
+}
+
+static void csi_stbm(struct my_sess *sh, int curcol, int cmd)
+{	/* change scroll region, defaults to the whole page */
+	int a1 = vt_param(sh, 0, 1), a2 = vt_param(sh, 1, sh->rows);
+
+	DBG(2, "scroll region to %d, %d\n", a1-1, a2-1);
+	/* change y scroll region to a1-1,a2-1,
+	 * position cursor to row a1-1
+	 */
+	if (a1 <= a2 && a2 <= sh->rows) {
+		sh->scroll_top = a1 - 1;
+		sh->scroll_bottom = a2;
+		sh->scroll_gen = 0;	/* new rows to stamp */
+		sh->cur = (a1 - 1) * sh->cols;
+		B();
+	}
+}
+
+static void csi_ech(struct my_sess *sh, int curcol, int cmd)
+{	/* erase char, the next n characters */
+	int a1 = vt_param(sh, 0, 1);
+
+	if (a1 + curcol > sh->cols)
+		a1 = sh->cols - curcol;
+	erase(sh, sh->cur,  a1);
+}
+
+/* indexed by final byte - 0x40 */
+static const csi_fn csi_table[0x3f] = {
+	['A' - 0x40] = csi_cuu,
+	['B' - 0x40] = csi_cud,
+	['C' - 0x40] = csi_cuf,
+	['D' - 0x40] = csi_cub,
+	['G' - 0x40] = csi_cha,
+	['`' - 0x40] = csi_cha,
+	['H' - 0x40] = csi_cup,
+	['f' - 0x40] = csi_cup,
+	['d' - 0x40] = csi_vpa,
+	['g' - 0x40] = csi_ignore,
+	['h' - 0x40] = csi_mode,
+	['l' - 0x40] = csi_mode,
+	['J' - 0x40] = csi_ed,
+	['K' - 0x40] = csi_el,
+	['m' - 0x40] = csi_sgr,
+	['P' - 0x40] = csi_dch,
+	['@' - 0x40] = csi_ich,
+	['L' - 0x40] = csi_il,
+	['M' - 0x40] = csi_il,
+	['S' - 0x40] = csi_su,
+	['T' - 0x40] = csi_su,
+	['c' - 0x40] = csi_da,
+	['n' - 0x40] = csi_dsr,
+	['p' - 0x40] = csi_decrqm,
+	['t' - 0x40] = csi_winops,
+	['s' - 0x40] = csi_scosc,
+	['u' - 0x40] = csi_scosc,
+	['r' - 0x40] = csi_stbm,
+	['X' - 0x40] = csi_ech,
+};
+
+/* the private markers and intermediates we support, by final byte */
+static int vt_csi_known(struct my_sess *sh, int c)
+{
+	if (sh->vt_ninter)	/* only DECRQM */
+		return c == 'p' && !strcmp(sh->vt_inter, "$") &&
+			(!sh->vt_mark || sh->vt_mark == '?');
+	if (c == 'p')
+		return 0;
+	switch (sh->vt_mark) {
+	case 0:
+		return 1;
+	case '?':	/* DEC modes, DSR */
+		return c == 'h' || c == 'l' || c == 'n';
+	case '>':	/* secondary DA */
+		return c == 'c';
+	}
+	return 0;
+}
+
+static void vt_csi_dispatch(struct my_sess *sh, int c, int curcol)
+{
+	csi_fn fn = csi_table[c - 0x40];
+
+	DBG(3, "+++ CSI %c with %d params\n", c, sh->vt_nparams);
+	if (!fn || !vt_csi_known(sh, c))
+		vt_unknown(sh, "ANSI sequence", "[", c);
+	else
+		fn(sh, curcol, c);
+}
+
+/*
+ * ESC-( 	charset G0 used
+ * ESC-) 	charset G1 used
+ * ESC-=	keypad mode 1
+ * ESC->	keypad mode 0
+ * ESC-H	memorize tab position as X
+ * ESC-7, ESC-8	save and restore the cursor
+ * ESC-D, ESC-E, ESC-M	index, next line, reverse index
+ */
+static void vt_esc_dispatch(struct my_sess *sh, int c)
+{
+	if (sh->vt_ninter == 1 && index("()", sh->vt_inter[0])) {
+	    /* treat g0 and g1 the same */
+	    switch (c) {
+	    case '0':	/* g0_scs_special graphics */
+		DBG(1, "enter graphics at %d\n", sh->cur);
+		sh->kflags |= (sh->vt_inter[0] == '(') ?
+			(kf_graphics | kf_dographic) : kf_dographic;
+		break;
+	    case 'B':	/* g0_scs_us_ascii */
+		DBG(1, "exit graphics at %d\n", sh->cur);
+		sh->kflags &= ~(kf_graphics | kf_dographic);
+		break;
+	    default:
+		DBG(0, "unrecognised ESC %c %c\n", sh->vt_inter[0], c);
+	    }
+	    return;
+	}
+	if (sh->vt_ninter) {
+		vt_unknown(sh, "non ANSI sequence", "", c);
+		return;
+	}
+	switch (c) {
+	case '7':
+		vt_save(sh);
+		break;
+	case '8':
+		vt_restore(sh);
+		break;
+	case 'E':
+		sh->cur -= sh->cur % sh->cols;
+		/* FALLTHROUGH */
+	case 'D':	/* down, scrolling at the bottom of the region */
+		if (sh->cur / sh->cols == sh->scroll_bottom - 1)
+			page_scroll(sh);
+		else if (sh->cur + sh->cols < sh->pagelen)
+			sh->cur += sh->cols;
+		sh->kflags &= ~kf_wrapped;
+		break;
+	case 'M':	/* up, scrolling at the top of the region */
+		if (sh->cur / sh->cols == sh->scroll_top)
+			page_move(sh, sh->scroll_top, sh->scroll_bottom, -1);
+		else if (sh->cur >= sh->cols)
+			sh->cur -= sh->cols;
+		sh->kflags &= ~kf_wrapped;
+		break;
+	case 'H':	/* horiz. tab set, ignore */
+	case '=':	/* keypad app mode */
+	case '>':	/* keypad numeric mode */
+	case '\\':	/* ST, end of a string */
+		break;
+	default:
+		DBG(0, "non ANSI sequence %d ESC-%c\n", c, c);
+	}
+}
+
+/* OSC strings, we only log them, e.g. ESC ] 0 ; title BEL */
+static void vt_osc_dispatch(struct my_sess *sh)
+{
+	sh->vt_osc[sh->vt_osclen] = '\0';
+	DBG(1, "OSC %s\n", sh->vt_osc);
+}
+
+/* actions on entering and leaving a state */
+static void vt_enter(struct my_sess *sh, int state)
+{
+	switch (state) {
+	case VS_ESCAPE:
+	case VS_CSI_ENTRY:
+	case VS_DCS_ENTRY:	/* clear */
+		sh->vt_nparams = 0;
+		sh->vt_params[0] = 0;
+		sh->vt_ninter = 0;
+		sh->vt_mark = 0;
+		break;
+	case VS_OSC:
+		sh->vt_osclen = 0;
+		break;
+	case VS_DCS_PASS:
+		DBG(1, "ignore DCS string\n");
+		break;
+	}
+}
+
+static void vt_leave(struct my_sess *sh, int state)
+{
+	if (state == VS_OSC)
+		vt_osc_dispatch(sh);
+}
+
+static void vt_collect(struct my_sess *sh, int c)
+{
+	if (c >= 0x3c && c <= 0x3f) {	/* private marker */
+		sh->vt_mark = c;
+	} else if (sh->vt_ninter < sizeof(sh->vt_inter) - 1) {
+		sh->vt_inter[sh->vt_ninter++] = c;
+		sh->vt_inter[sh->vt_ninter] = '\0';
+	}
+}
+
+static void vt_param_add(struct my_sess *sh, int c)
+{
+	int *p;
+
+	if (sh->vt_nparams == 0)
+		sh->vt_nparams = 1;
+	if (c == ';') {	/* extra parameters are dropped */
+		if (sh->vt_nparams < VT_MAXPARAMS)
+			sh->vt_params[sh->vt_nparams++] = 0;
+		return;
+	}
+	p = &sh->vt_params[sh->vt_nparams - 1];
+	if (*p < 10000)
+		*p = *p * 10 + c - '0';
+}
+
+static const uint16_t special[] = {	/* DEC graphics 0x60-0x7e */
+	0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+	0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+	0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+	0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+};
+
+/*
+ * attach the combining char c to the last char written, through
+ * an entry in marks[] for its page offset.
+ */
+static void page_mark(struct my_sess *sh, uint32_t c)
+{
+	int i, m = -1, off = sh->cur;
+	struct term_mark *e;
+	term_cell *x;
+
+	if (!(sh->kflags & kf_wrapped)) {
+		if (off % sh->cols == 0)
+			return;	/* nothing to attach to */
+		off--;
+	}
+	x = cell(sh, off);
+	if ((*x & CELL_CONT) && off % sh->cols) {	/* wide char */
+		x--;
+		off--;
+	}
+	off = sh->rowmap[off / sh->cols] * sh->cols + off % sh->cols;
+	for (i = 0; i < MARKS_MAX && m < 0; i++) {
+		e = sh->marks + i;
+		if (e->cp[0] && e->off == off && (*x & CELL_MARKS))
+			m = i;
+	}
+	for (i = 0; i < MARKS_MAX && m < 0; i++) {	/* a free entry */
+		e = sh->marks + i;
+		if (!e->cp[0] || !(sh->page[e->off] & CELL_MARKS))
+			m = i;
+	}
+	if (m < 0)
+		m = sh->marks_next++ % MARKS_MAX;
+	e = sh->marks + m;
+	if (e->off != off || !(*x & CELL_MARKS)) {
+		bzero(e, sizeof(*e));
+		e->off = off;
+	}
+	for (i = 0; i < TERM_MARKS && e->cp[i]; i++) ;
+	if (i < TERM_MARKS)
+		e->cp[i] = c;
+	*x |= CELL_MARKS;
+}
+
+/* store a printable char, or handle a newline */
+static void page_putc(struct my_sess *sh, int c, int curcol)
+{
+	term_cell *x;
+	int w = 1;
+
+	if (c >= 0x300 && (w = cp_width(c)) == 0) {
+		page_mark(sh, c);
+		return;
+	}
+	if (sh->kflags & kf_wrapped) { /* absorb the wrap */
+		sh->cur++;
+		B();
+		sh->kflags &= ~kf_wrapped;
+	} else if (c == '\n') {
+		sh->cur += sh->cols;
+		B();
+	}
+	if (sh->cur >= sh->scroll_bottom * sh->cols) {
+		sh->cur -= sh->cols;
+		B();
+		page_scroll(sh);
+	}
+	if (c == '\n') /* already handled above */
+		return;
+	curcol = sh->cur % sh->cols;
+	if (w == 2 && curcol == sh->cols - 1)
+		w = 1;	/* no room for the right half */
+	x = cell(sh, sh->cur);
+	if (sh->kflags & kf_insert) {	/* make room, the row moves right */
+		memmove(x + w, x, (sh->cols - curcol - w) * sizeof(*x));
+		wide_fix(sh, sh->cur, sh->cols);
+	}
+	if (c >= 0x60 && c < 0x7f &&
+	    (sh->kflags & kf_dographic) && sh->kflags & kf_graphics)
+		c = special[(c - 0x60)];
+	/* do not leave halves of the wide chars we overwrite */
+	if (curcol > 0 && (x[0] & CELL_CONT))
+		x[-1] = CELL(' ', CELL_ATTR(x[-1]));
+	if (curcol + w < sh->cols && (x[w] & CELL_CONT))
+		x[w] = CELL(' ', CELL_ATTR(x[w]));
+	x[0] = CELL(c, sh->cur_attr);
+	if (w == 2) {
+		x[0] |= CELL_WIDE;
+		x[1] = CELL(' ', sh->cur_attr) | CELL_CONT;
+	}
+	if (curcol + w < sh->cols) {
+		sh->cur += w;
+	} else {
+		sh->cur += w - 1;
+		if (sh->nowrap)
+			sh->kflags |= kf_wrapped;
+	}
+}
+
+/*
+ * Feed byte c >= 0x80 to the UTF-8 decoder. Returns the codepoint
+ * when complete, U+FFFD for invalid input, -1 if more bytes are needed.
+ * page_append() reports truncated sequences.
  */
-int term_state(struct sess *sess, struct term_state *ptr)
+static int utf8_step(struct my_sess *sh, int c)
 {
-	struct my_sess *sh = (struct my_sess *)sess;
-	int ret;
-	if (!sh)
-		return 0;
-	ret = sh->modified;
-	DBG(2, "called on %s %s modified %d\n", sh->name,
-		ptr ? "reset" : "keep", ret);
-	if (ptr) {
-		if (ptr->flags & TS_MOD)
-			sh->modified = ptr->modified;
-		else
-			ptr->modified = sh->modified;
-		if (ptr->flags & TS_CB)
-			sh->cb = ptr->cb;
-		else
-			ptr->cb = sh->cb;
-		if (ptr->flags & TS_NAME)
-			sh->name = ptr->name;
-		else
-			ptr->name = sh->name;
-		ptr->rows = sh->rows;
-		ptr->rows = sh->rows;
-		ptr->cols = sh->cols;
-		ptr->cur = (sh->kflags & kf_nocursor) ? -1 : sh->cur;
-		ptr->data = sh->page;
+	if ((c & 0xc0) == 0x80) {	/* continuation */
+		if (sh->utf_need == 0)
+			return 0xfffd;
+		sh->utf_cp = sh->utf_cp << 6 | (c & 0x3f);
+		if (--sh->utf_need)
+			return -1;
+		if (sh->utf_cp < sh->utf_min || sh->utf_cp > 0x10ffff ||
+		    (sh->utf_cp >= 0xd800 && sh->utf_cp < 0xe000))
+			return 0xfffd;	/* overlong, too large, surrogate */
+		return sh->utf_cp;
 	}
-	return ret;
+	if (c >= 0xc2 && c < 0xe0) {
+		sh->utf_need = 1;
+		sh->utf_min = 0x80;
+	} else if (c >= 0xe0 && c < 0xf0) {
+		sh->utf_need = 2;
+		sh->utf_min = 0x800;
+	} else if (c >= 0xf0 && c < 0xf5) {
+		sh->utf_need = 3;
+		sh->utf_min = 0x10000;
+	} else {
+		return 0xfffd;
+	}
+	sh->utf_cp = c & (0x3f >> sh->utf_need);
+	return -1;
 }
 
-/* erase part of the 'screen' from 'start' for 'len' bytes.
- * also taking care of the attributes.
+/*
+ * Length of the run of printable ASCII (0x20-0x7e) at p, at most n.
+ * Scans 16 bytes at a time with SSE2 or NEON when available.
  */
-static void erase(struct my_sess *sh, int start, int len)
+static int vt_printable(const uint8_t *p, int n)
 {
-	char *x = sh->page + start;
-	DBG(2, "x %p start %d pagelen %d len %d\n", x, start, sh->pagelen, len);
-	memset(x, ' ', len);
-	memset(x + sh->pagelen, sh->cur_attr, len);
-}
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
 
-/* scroll up one line, erase last line */
-static void page_scroll(struct my_sess *sh)
-{
-	char *p = sh->page + sh->scroll_top * sh->cols;
-	int l = (sh->scroll_bottom - sh->scroll_top - 1) * sh->cols;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		/* signed, bytes >= 0x80 are negative */
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(x, lo),
+			_mm_cmplt_epi8(x, hi));
+		int m = _mm_movemask_epi8(ok) ^ 0xffff;
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+#elif defined(__ARM_NEON__)
+	const uint8x16_t lo = vdupq_n_u8(0x20), hi = vdupq_n_u8(0x7e);
 
-	memcpy(p, p + sh->cols, l);
-	p += sh->pagelen;	/* move to attributes */
-	memcpy(p, p + sh->cols, l);
-	erase(sh, (sh->scroll_bottom - 1)*sh->cols, sh->cols);
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t x = vld1q_u8(p + i);
+		uint64x2_t m = vreinterpretq_u64_u8(vorrq_u8(vcltq_u8(x, lo),
+			vcgtq_u8(x, hi)));
+		if (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1))
+			break;	/* the loop below finds it */
+	}
+#endif
+	for (; i < n && p[i] >= 0x20 && p[i] < 0x7f; i++) ;
+	return i;
 }
 
-#define B() do {	\
-		if (sh->cur < 0) {	\
-			DBG(0, "cur %d\n", sh->cur); \
-			sh->cur = 0;	\
-		} else if (sh->cur > sh->pagelen) { \
-			DBG(0, "cur %d\n", sh->cur); \
-			sh->cur = sh->pagelen;	\
-		} \
-	} while(0)
 /*
- * interpret a CSI sequence. Return 0 if all ok, 1 if the sequence
- * is incomplete so we should wait for more chars. In all cases, *s
- * points to the first unused character.
- * Codes are taken from the FreeBSD 'syscons' driver.
+ * Fast path for printable ASCII in the ground state. The run up to
+ * the end of the row is stored in one loop, which gives
+ * the same result as page_putc() on each char.
+ * Returns the number of bytes used, at least 1.
  */
-static int do_csi(struct my_sess *sh, char **s, int curcol)
-{
-	/* see http://en.wikipedia.org/wiki/ANSI_escape_code */
-	char *x, *parm, *base = *s + 2, cmd, mark=' ';
-	int n;
-	int a1= 1, a2= 1, a3 = 1;
-
-	DBG(3, "+++ CSI FOUND ESC-%s\n", *s+1);
-	/* index() matches a NUL, so we need to check before */
-	if (!*base)
-		return 1;	// process later
-	if (index("<=>?", *base)) /* private ANSI code */
-		mark = *base++;
-	if (!*base)
-		return 1; // process later
-	// skip parameters
-	for (parm = base; *parm && index("0123456789;", *parm); parm++) ;
-	DBG(3, "+++ now PARM %s\n", parm);
-	cmd = parm[0];
-	if (!cmd)
-		return 1; // process later
-	*s = parm;
-	/* XXX parse a variable number of args */
-	n = sscanf(base, "%d;%d;%d", &a1, &a2, &a3);
-	/* print potentially invalid commands */
-	if (!index("ABCDGHJKPXdghlmr", cmd))
-	    DBG(0, "ANSI sequence (%d)(%d) %d %d %d cmd %d( ESC-[%.*s)\n",
-		n, mark, a1, a2, a3, cmd, (parm+1 - base), base);	
-	switch (cmd) {
-	case 'A': // up, hang at curcol
-		sh->cur -= sh->cols * a1;
-		if (sh->cur < 0)
-			sh->cur = curcol;
-		break;
-	case 'B': // down, hang at curcol
-		sh->cur += sh->cols * a1;
-		if (sh->cur >= sh->pagelen)
-			sh->cur = sh->pagelen -sh->cols + curcol;
-		break;
-	case 'C':	// right
-		if (a1 >= sh->cols - curcol)
-			a1 = sh->cols - curcol - 1;
-		sh->cur += a1;
+static int page_puts(struct my_sess *sh, const uint8_t *p, int n)
+{
+	int i, curcol = sh->cur % sh->cols;
+	int k = sh->cols - 1 - curcol;	/* chars that advance the cursor */
+	term_cell *x, a = CELL(0, sh->cur_attr);
+
+	if ((sh->kflags & (kf_wrapped | kf_insert)) ||
+	    sh->cur >= sh->scroll_bottom * sh->cols ||
+	    ((sh->kflags & kf_dographic) && (sh->kflags & kf_graphics))) {
+		page_putc(sh, *p, curcol);
+		return 1;
+	}
+	n = vt_printable(p, (sh->nowrap && n > k + 1) ? k + 1 : n);
+	if (n < k)
+		k = n;
+	x = cell(sh, sh->cur);
+	if (curcol > 0 && (x[0] & CELL_CONT))	/* see page_putc() */
+		x[-1] = CELL(' ', CELL_ATTR(x[-1]));
+	for (i = 0; i < k; i++)
+		x[i] = p[i] | a;
+	if (x[k] & CELL_CONT)
+		x[k] = CELL(' ', CELL_ATTR(x[k]));
+	sh->cur += k;
+	if (n == k)
+		return n;
+	if (sh->nowrap) {
+		page_putc(sh, p[k], sh->cols - 1);
+		return k + 1;
+	}
+	/* the rest overwrites the last column, only the last char stays */
+	x[k] = p[n - 1] | a;
+	return n;
+}
+
+/* C0 controls, the others are ignored */
+static void vt_execute(struct my_sess *sh, int c, int curcol)
+{
+	switch (c) {
+	case '\r': /* CR */
+		sh->cur -= curcol;
 		B();
 		break;
-	case 'D': // left
-		if (a1 > curcol)
-			a1 = curcol;
-		sh->cur -= a1;
-		B();
+	case '\n':
+	case 0x0b: /* VT */
+	case 0x0c: /* FF */
+		page_putc(sh, '\n', curcol);
 		break;
-	case 'G':	/* horizontal position absolute */
-	case '`':	/* horizontal position absolute */
-		if (a1 > sh->cols)
-			a1 = sh->cols;
-		sh->cur += (a1 -1 ) - curcol;
-		B();
+	case 0x0e: /* shift-out */
+		sh->kflags |= kf_dographic;
 		break;
-	case 'H':
-	case 'f': // both are cursor position, ok
-		DBG(2, "a1 %d a2 %d\n", a1, a2);
-		if (a1 > sh->rows)
-			a1 = sh->rows;
-		else if (a1 < 1)
-			a1 = 1;
-		if (a2 > sh->cols)
-			a2 = sh->cols;
-		else if (a2 < 1)
-			a2 = 1;
-		// XXX a1 -1 or just a1 ?
-		sh->cur = (a1 - 1)*sh->cols + a2 - 1;
-		B();
+	case 0x0f: /* shift-in */
+		sh->kflags &= ~kf_dographic;
 		break;
-	case 'd':	/* vertical position absolute */
-		if (a1 >= sh->rows)
-			a1 = sh->rows;
-		sh->cur = (a1 - 1)*sh->cols + curcol;
+	case '\t':	/* XXX simplified version, 8-pos tabs */
+		if (curcol >= sh->pagelen - 8)
+			sh->cur += (sh->cols - 1 - curcol);
+		else
+			sh->cur += 8 - (sh->cur % 8);
 		B();
 		break;
-	case 'g':	/* tab clear, ignore */
-		break;
-	case 'h':	/* set mode/set dec mode, incomplete */
-		if (mark == '?') {
-		    switch (a1) {
-		    case 1: /* Cursor keys mode. */
-			sh->kflags |= kf_priv; /* set cursor mode */
-			break;
-		    case 25: /* Display cursor. */
-			sh->kflags &= ~kf_nocursor;
-			break;
-		    case 7: /* Autowrap mode. */
-			//s->nowrap = 0; // XXX
-			//break;
-		    case 2: /* DECANM: ANSI/VT52 mode. */
-		    case 3: /* 132 column mode. */
-		    case 5: /* Inverse video. */
-		    case 6: /* Origin mode. */
-#if 0
-			    t->t_stateflags |= TS_ORIGIN;
-			    t->t_originreg = t->t_scrollreg;
-			    t->t_cursor.tp_row = t->t_scrollreg.ts_begin;
-			    t->t_cursor.tp_col = 0;
-			    t->t_stateflags &= ~TS_WRAPPED;
-			    teken_funcs_cursor(t);
-#endif
-		    case 8: /* Autorepeat mode. */
-		    case 40: /* Allow 132 columns. */
-		    case 45: /* Enable reverse wraparound. */
-		    case 47: /* Switch to alternate buffer. */
-		    default:
-			goto notfound;
-		    }
-		} else {
-		    switch (a1) {
-		    case 4: 	/* insert mode */
-		    default:
-			goto notfound;
-		    }
-		}
-		break;
-	case 'J': /* erase display, fixed */
-		if (n == 0)
-			a1 = 0;
-		if (a1 == 1) {	/* erase from top to cursor */
-			erase(sh, 0, sh->cur);
-		} else if (a1 == 2) { /* erase entire page */
-			erase(sh, 0, sh->pagelen);
-			// sh->cur = 0; // XXX msdos ansy.sys
-		} else { /* erase from cursor to bottom */
-			erase(sh, sh->cur, sh->pagelen - sh->cur);
-		}
-		break;
-	case 'K': /* erase line, ok */
-		if (n == 0)
-			a1 = 0;
-		if (a1 == 1) { /* from beg. to cursor */
-			erase(sh, sh->cur - curcol, curcol);
-		} else if (a1 == 2) { /* entire line */
-			x = sh->page + sh->cur - curcol;
-			erase(sh, sh->cur - curcol, sh->cols);
-		} else { /* from cursor to end of line */
-			x = sh->page + sh->cur;
-			erase(sh, sh->cur, sh->cols - curcol);
-		}
-		break;
-	case 'l': /* reset mode */
-		/* n = 1, mark = '?' */
-		if (mark == '?') { /* reset dec mode */
-		    switch (a1) {
-		    case 1: /* normal cursors */
-			sh->kflags &= ~kf_priv; /* back to normal */
-			break;
-		    case 25: /* Hide cursor. */
-			sh->kflags |= kf_nocursor;
-			break;
-		    case 2: /* DECANM: ANSI/VT52 mode. */
-		    case 3: /* 132 column mode. */
-		    case 5: /* Inverse video. */
-		    case 6: /* Origin mode. */
-		    case 7: /* Autowrap mode. */
-		    case 8: /* Autorepeat mode. */
-		    case 12: // XXX what ?
-		    case 40: /* Disallow 132 columns. */
-		    case 45: /* Disable reverse wraparound. */
-		    case 47: /* Switch to alternate buffer. */
-		    default:
-			// we got 12, 1000, 1049
-			goto notfound;
-		    }
-		} else {	/* reset mode */
-		    switch (a1) {
-		    case 4: /* disable insert mode */
-		    default:
-			goto notfound;
-		    }
-		}
-		/* XXX resets the INSERT flag */
-		break;
-	case 'm': /* set_graphic_rendition */
-	    {
-		/* right now ignore attributes, fix later */
-		int i, arg[3] = {a1, a2, a3};
-		if (n == 0) {
-			arg[0] = 0;
-			n = 1;
-		}
-		for (i=0; i < 3 && i < n; i++) {
-		    switch(arg[i]) {
-		    case 0: /* reset */
-			sh->cur_attr = 0;
-			break;
-		    case 1: /* bold */
-		    case 4: /* underline */
-		    case 5: /* blink */
-		    case 7: /* reverse */
-		    case 22: /* remove bold */
-		    case 24: /* remove underline */
-		    case 25: /* remove blink */
-		    case 27: /* remove reverse */
-		    case 30: /* Set foreground color: black */
-		    case 31: /* Set foreground color: red */
-		    case 32: /* Set foreground color: green */
-		    case 33: /* Set foreground color: brown */
-		    case 34: /* Set foreground color: blue */
-		    case 35: /* Set foreground color: magenta */
-		    case 36: /* Set foreground color: cyan */
-		    case 37: /* Set foreground color: white */
-		        DBG(2, "setattr fg %d\n", arg[i]);
-			sh->cur_attr &= ~ka_fg;
-			sh->cur_attr |= (37 - arg[i]);
-			break;
-		    case 39: /* Set default foreground color. */
-		        DBG(2, "setattr fg %d\n", arg[i]);
-			sh->cur_attr &= ~ka_fg;
-			break;
-		    case 40: /* Set background color: black */
-		    case 41: /* Set background color: red */
-		    case 42: /* Set background color: green */
-		    case 43: /* Set background color: brown */
-		    case 44: /* Set background color: blue */
-		    case 45: /* Set background color: magenta */
-		    case 46: /* Set background color: cyan */
-		    case 47: /* Set background color: white */
-		        DBG(1, "setattr bg %d\n", arg[i]);
-			sh->cur_attr &= ~ka_bg;
-			sh->cur_attr |= (47 - arg[i]) << ka_bg_shift;
-			break;
-		    case 49: /* Set default background color. */
-		        DBG(1, "setattr bg %d\n", arg[i]);
-			sh->cur_attr &= ~ka_bg;
-			break;
-		    default:
-			goto notfound;
-		    }
-		}
-	    }
-		break;
-	case 'P': /* delete n characters */
-		if (curcol + a1 < sh->cols) {
-			char *dst = sh->page + sh->cur;
-			int l = sh->cols - curcol - a1;
-			memcpy(dst, dst + a1, l);
-			dst += sh->pagelen;
-			memcpy(dst, dst + a1, l); /* attributes */
-			erase(sh, sh->cur + l, a1);
-		} else {
-			erase(sh, sh->cur, sh->cols - curcol);
-		}
-		break;
-	case 'r': /* change scroll region */
-		DBG(2, "scroll region to %d, %d\n", a1-1, a2-1);
-		/* change y scroll region to a1-1,a2-1,
-		 * position cursor to row a1-1
-		 */
-		if (n == 0) {	/* defaults */
-			a1 = 1;
-			a2 = sh->rows - 1;
-		}
-		if (a1 >= 1 && a1 <= a2 && a2 <= sh->rows) {
-			sh->scroll_top = a1 - 1;
-			sh->scroll_bottom = a2;
-			sh->cur = (a1 - 1) * sh->cols;
-			B();
-		}
-		break;
-	case 'X':	/* erase char, the next n characters */
-		if (a1 + curcol > sh->cols)
-			a1 = sh->cols - curcol;
-		erase(sh, sh->cur,  a1);
+	case '\b': // backspace
+		if (curcol > 0)
+			sh->cur--;
+		B();
 		break;
-	default:
-	notfound:
-		DBG(0, "-- at %4d ANSI sequence (%d) %d %d %d ( ESC-[%c%.*s)\n",
-			sh->cur,
-			n, a1, a2, a3, mark, (parm+1 - base), base);	
 	}
-	return 0;
 }
 
 /*
- * append a string to a page, interpreting ANSI sequences
- * Returns a pointer to leftover chars.
+ * append len bytes to a page, interpreting ANSI sequences.
+ * Incomplete sequences are kept in the parser state.
  */
-static char *page_append(struct my_sess *sh, char *s)
+static void page_append(struct my_sess *sh, const char *s, int len)
 {
-    const uint8_t special[] = {	/* box drawing chars, UTF8 and CP-437 */
-    //	0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
-	'?',	0xb1,	'?',	'?',	'?',	'?',	0xf8,	0xf1,
-    //	0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
-	'?',	'?',	0xd9,	0xbf,	0xda,	0xc0,	0xc5,	'?',
-    //	0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
-	'?',	0xc4,	'?',	'?',	0xc3,	0xb4,	0xc1,	0xc2,
-    //	0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
-	0xb3,	0xf3,	0xf2,	0xe3,	'?',	0x9c,	0xfa,	'?'
-	};
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    int c, e, next, curcol;
 
-    for (; *s; s++) {
-	char c = *s;
-	int curcol;
+    for (; p < end; p++) {
+	c = *p;
 	if (sh->cur >= sh->pagelen) { // XXX the '>' should not happen ?
 	    DBG(0, "+++ scroll at %d / %d +++\n", sh->cur, sh->pagelen);
 	    sh->cur = sh->pagelen - sh->cols; // beginning of last line
 	    page_scroll(sh);
 	}
+	if (sh->utf_need && (c & 0xc0) != 0x80) {	/* truncated */
+	    sh->utf_need = 0;
+	    page_putc(sh, 0xfffd, sh->cur % sh->cols);
+	}
 	curcol = sh->cur % sh->cols;
-	switch (c) {
-	case '\r': /* CR */
-	    sh->cur -= curcol;
-		B();
+	if (sh->vt_state == VS_GROUND && c >= 0x20) {
+	    if (c < 0x7f)
+		p += page_puts(sh, p, end - p) - 1;
+	    else if (c >= 0x80 && (c = utf8_step(sh, c)) >= 0)
+		page_putc(sh, c, curcol);
+	    continue;	/* DEL is ignored */
+	}
+	e = vt_table[sh->vt_state][c];
+	next = e & 0xf;
+	/* ESC restarts a sequence even in the escape state */
+	if (next != sh->vt_state || c == 0x1b)
+	    vt_leave(sh, sh->vt_state);
+	switch (e >> 4) {
+	case VA_PRINT:
+	    page_putc(sh, c, curcol);
 	    break;
-	case 0x0e: /* shift-out */
-	    sh->kflags |= kf_dographic;
+	case VA_EXECUTE:
+	    vt_execute(sh, c, curcol);
 	    break;
-	case 0x0f: /* shift-in */
-	    sh->kflags &= ~kf_dographic;
+	case VA_COLLECT:
+	    vt_collect(sh, c);
 	    break;
-	case 7:	/* BEL, ignore */
+	case VA_PARAM:
+	    vt_param_add(sh, c);
 	    break;
-	case '\t':	/* XXX simplified version, 8-pos tabs */
-	    if (curcol >= sh->pagelen - 8)
-		sh->cur += (sh->cols - 1 - curcol);
-	    else
-		sh->cur += 8 - (sh->cur % 8);
-	    B();
+	case VA_ESC_DISPATCH:
+	    vt_esc_dispatch(sh, c);
 	    break;
-	case '\b': // backspace
-	    if (curcol > 0)
-		    sh->cur--;
-	    B();
+	case VA_CSI_DISPATCH:
+	    vt_csi_dispatch(sh, c, curcol);
 	    break;
-	case '\033': /* escape */
-	    if (!s[1])
-		goto done;	// incomplete sequence, process later
-	    if (s[1] == '[' ) { // CSI found
-		if (do_csi(sh, &s, curcol))
-			goto done;	/* continue later */
-	    } else {
-		if (!index("()>=H", s[1]))
-		    DBG(0, "other ESC-%.*s\n", 1, s+1);
-		/*
-		 * ESC-( 	charset G0 used
-		 * ESC-) 	charset G1 used
-		 * ESC-=	keypad mode 1
-		 * ESC->	keypad mode 0
-		 * ESC-H	memorize tab position as X
-		 */
-		if (index("()", s[1])) { /* treat g0 and g1 the same */
-		    if (!s[2])
-			return s; // process later
-		    s += 2;
-		    switch (*s) {
-		    case '0':	/* g0_scs_special graphics */
-			DBG(1, "enter graphics at %d\n", sh->cur);
-			sh->kflags |= (s[-1] == '(') ?
-				(kf_graphics | kf_dographic) :
-				kf_dographic;
-			break;
-		    case 'B':	/* g0_scs_us_ascii */
-			DBG(1, "exit graphics at %d\n", sh->cur);
-			sh->kflags &= ~(kf_graphics | kf_dographic);
-			break;
-		    default:
-			DBG(0, "unrecognised ESC ( %c\n", *s);
-		    }
-		} else if (index("H=>", s[1])) { /* ignore these */
-		    /* H horiz. tab set, ignore */
-		    /* = keypad app mode */
-		    /* > keypad numeric mode */
-		    s++;
-		} else {
-		    DBG(0, "non ANSI sequence %d ESC-%c\n", s[1], s[1]);
-		    s++;	/* skip the char */
-		}
-	    }
+	case VA_OSC_PUT:
+	    if (sh->vt_osclen < VT_OSC_MAX - 1)
+		sh->vt_osc[sh->vt_osclen++] = c;
 	    break;
-	default:	/* all other chars */
-	    /* XXX make room in insert mode ? */
-	    if (sh->kflags & kf_wrapped) { /* absorb the wrap */
-		sh->cur++;
-		B();
-		sh->kflags &= ~kf_wrapped;
-	    } else if (*s == '\n') {
-		sh->cur += sh->cols;
-		B();
-	    }
-	    if (sh->cur >= sh->scroll_bottom * sh->cols) {
-		sh->cur -= sh->cols;
-		B();
-		page_scroll(sh);
-	    }
-	    if (*s == '\n') /* already handled above */
-		break;
-	    if (*s >= 0x60 && *s < 0x7f &&
-		(sh->kflags & kf_dographic) && sh->kflags & kf_graphics) 
-		sh->page[sh->cur] = special[(*s - 0x60)];
-	    else
-		sh->page[sh->cur] = *s;
-	    sh->page[sh->cur + sh->pagelen] = sh->cur_attr;
-	    if (curcol != sh->cols -1)
-		sh->cur++;
-	    else if (sh->nowrap)
-		sh->kflags |= kf_wrapped;
+	}
+	if (next != sh->vt_state || c == 0x1b) {
+	    sh->vt_state = next;
+	    vt_enter(sh, next);
 	}
 	if (sh->cur >= sh->pagelen) {
 	    DBG(0,"--- ouch, overflow on c %d\n", c);
 	    sh->cur = 0; // XXX what should we do ? */
 	}
     }
-done:
-    if (*s) {
-	DBG(3, "----- leftover stuff ESC [%s]\n", s+1);
-    }
-    return s;
 }
 
+/* send the queue to the pty, in two parts if the ring wraps */
 static int term_keyboard(struct my_sess *sh)
 {
-	int l = write(sh->sess.fd, sh->keys, sh->klen);
+	struct iovec iov[2];
+	int l, n = sh->ksize - sh->khead;
+
+	if (n > sh->klen)
+		n = sh->klen;
+	iov[0].iov_base = sh->keys + sh->khead;
+	iov[0].iov_len = n;
+	iov[1].iov_base = sh->keys;
+	iov[1].iov_len = sh->klen - n;
+	l = writev(sh->sess.fd, iov, n < sh->klen ? 2 : 1);
 	if (l <= 0) {
 		DBG(1, "error writing to keyboard\n");
-		return 1; /* error, currently ignored */
+		if (l < 0 && errno == EAGAIN)
+			return 1;
+		/* the pty is gone, drop the keys or we would spin */
+		l = sh->klen;
+	} else if (l < sh->klen) {
+		DBG(2, "short write to keyboard %d out of %d\n", l, sh->klen);
 	}
-	if (l < sh->klen)
-		DBG(0, "short write to keyboard %d out of %d\n", l, sh->klen);
 	// ioctl(sh->sess.fd, TIOCDRAIN); // XXX blocks
-	strcpy(sh->keys, sh->keys + l);
+	sh->khead += l;
+	if (sh->khead >= sh->ksize)
+		sh->khead -= sh->ksize;
 	sh->klen -= l;
+	if (sh->klen)
+		return 0;
+	sh->khead = 0;
+	if (sh->ksize > KEYS_INIT) {	/* a paste is over */
+		free(sh->keys);
+		sh->keys = NULL;
+		sh->ksize = 0;
+	}
+	term_watch(sh);
 	return 0;
 }
 
-/* process screen output from the shell */
+/*
+ * process screen output from the shell. We read until EAGAIN or
+ * SCREEN_BUDGET bytes, and parse after each read. The parser keeps
+ * its state, so nothing is left in sbuf.
+ * Returns 0 if we got data, 1 if none is available, -1 on error.
+ */
 static int term_screen(struct my_sess *sh)
 {
-	char *s;
-	int spos = strlen(sh->sbuf);
-	int l = read(sh->sess.fd, sh->sbuf + spos, sizeof(sh->sbuf) - 1 - spos);
+	int l = 0, got = 0;
 
-	if (l <= 0) {
-		DBG(0, "--- shell read error, dead %d\n", l);
-		sh->sess.fd = -1; /* report error. */
+	while (got < SCREEN_BUDGET) {
+		l = SCREEN_BUDGET - got;
+		l = read(sh->sess.fd, sh->sbuf,
+			l < TERM_BUFSIZE ? l : TERM_BUFSIZE);
+		if (l <= 0)
+			break;
+		got += l;
+		page_append(sh, sh->sbuf, l);
+	}
+	/* what is left tells if the child outruns us */
+	if (l > 0 && ioctl(sh->sess.fd, FIONREAD, &sh->stats.backlog) == 0) {
+		if (sh->stats.backlog_max < sh->stats.backlog)
+			sh->stats.backlog_max = sh->stats.backlog;
+	} else {
+		sh->stats.backlog = 0;
+	}
+	sh->flood = (got >= SCREEN_BUDGET ||
+		sh->stats.backlog >= FLOOD_BACKLOG);
+	if (got > 0) {
+		DBG(2, "got %d bytes for %s\n", got, sh->name);
+		return 0;
+	}
+	if (l < 0 && errno == EAGAIN)
 		return 1;
+	DBG(0, "--- shell read error, dead %d\n", l);
+	return -1;
+}
+
+/*
+ * the page changed, can we report it ? In a flood only every
+ * FLOOD_FRAME_MS: a change held back is 'late', and reported when
+ * the interval ends even if no more output comes.
+ * In a synchronized update only the frames already ended.
+ */
+static int term_frame_due(struct my_sess *sh)
+{
+	uint64_t now = now_ms();
+
+	if (!sh->frame && (sync_held(sh) || !page_changed(sh)))
+		return 0;
+	if (sh->flood && now - sh->last_frame < FLOOD_FRAME_MS) {
+		sh->stats.dropped++;
+		sh->late = 1;
+#ifndef TERM_THREADS
+		timer_arm(&sh->frame_due, sh->last_frame + FLOOD_FRAME_MS - now);
+#endif
+		return 0;
+	}
+	sh->late = 0;
+	sh->last_frame = now;
+	sh->frame = 0;
+	return 1;
+}
+
+/* the screen changed, notify on the first change after a reset */
+static void term_modified(struct my_sess *sh)
+{
+	if (!sh->modified) { /* maybe not... */
+		sh->modified = 1;
+		if (sh->cb)
+			sh->cb(&sh->sess, TE_MODIFIED);
+	}
+}
+
+/* release the pty, the session dies once the child is gone too */
+static void term_close(struct my_sess *sh)
+{
+	sess_watch(&sh->sess, sh->sess.fd, 0);
+	close(sh->sess.fd);
+	sh->sess.fd = -1;
+#ifdef TERM_THREADS
+	if (sh->ctl[0] >= 0) {
+		sess_watch(&sh->sess, sh->ctl[0], 0);
+		close(sh->ctl[0]);
+		close(sh->ctl[1]);
+		sh->ctl[0] = sh->ctl[1] = -1;
+	}
+#endif
+}
+
+#ifdef TERM_THREADS
+/* parser side: wake up the loop unless a notification is pending */
+static void term_notify(struct my_sess *sh)
+{
+	if (__sync_lock_test_and_set(&sh->notified, 1) == 0)
+		write(sh->ctl[1], "n", 1);
+}
+
+/*
+ * parser side: in a flood, with flow control, stop reading until the
+ * loop has fetched the last change. term_resume() sends 'r' then.
+ */
+static void term_throttle(struct my_sess *sh)
+{
+	if (!sh->flow || !sh->flood)
+		return;
+	sh->throttled = 1;
+	__sync_synchronize();	/* pairs with term_resume() */
+	if (sh->modified) {
+		sh->stats.throttles++;
+		DBG(2, "throttle %s\n", sh->name);
+	} else {
+		sh->throttled = 0;
+	}
+}
+
+/* parser side: publish the page and notify if due */
+static void term_frame(struct my_sess *sh)
+{
+	if (!term_frame_due(sh))
+		return;
+	if (page_changed(sh) && !sync_held(sh))
+		snap_publish(sh);
+	term_notify(sh);
+}
+
+/* parser side: poll timeout, -1 or until a change held back is due */
+static int frame_wait(struct my_sess *sh)
+{
+	uint64_t now = now_ms(), due = UINT64_MAX;
+
+	if (sh->late)
+		due = sh->last_frame + FLOOD_FRAME_MS;
+	if (sh->sync && sh->sync_start + SYNC_MAX_MS < due)
+		due = sh->sync_start + SYNC_MAX_MS;
+	if (due == UINT64_MAX)
+		return -1;
+	return due > now ? due - now : 0;
+}
+
+/*
+ * The parser thread. Reads in batches and publishes a snapshot after
+ * each batch, or less often in a flood. It terminates on a pty error,
+ * or on a stop request from the loop, after collecting the last
+ * output of the child.
+ */
+static void *term_parser(void *arg)
+{
+	struct my_sess *sh = arg;
+	struct pollfd pfd[2];
+	char buf[16];
+	int i, l, ret = 0, stop = 0;
+
+	pfd[0].fd = sh->sess.fd;
+	pfd[1].fd = sh->ctl[1];
+	pfd[1].events = POLLIN;
+	while (ret >= 0 && !stop) {
+		pfd[0].events = sh->throttled ? 0 : POLLIN;
+		if (poll(pfd, 2, frame_wait(sh)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (sh->sync && !sync_held(sh)) {	/* frame too long */
+			DBG(1, "sync timeout on %s\n", sh->name);
+			sh->sync = 0;
+			term_frame(sh);
+		}
+		if (sh->late && now_ms() - sh->last_frame >= FLOOD_FRAME_MS)
+			term_frame(sh);
+		if (pfd[1].revents) { /* stop or resume */
+			while ( (l = read(sh->ctl[1], buf, sizeof(buf))) > 0)
+				for (i = 0; i < l; i++)
+					stop |= (buf[i] == 's');
+			sh->throttled = 0;
+			if (stop) {
+				for (i = 0; i < DRAIN_READS && term_screen(sh) == 0; i++) ;
+				break;
+			}
+		}
+		if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		for (i = 0; i < PARSE_READS && (ret = term_screen(sh)) == 0; i++) ;
+		term_frame(sh);
+		term_throttle(sh);
+	}
+	snap_publish(sh);
+	sh->done = 1;
+	__sync_synchronize();
+	write(sh->ctl[1], "d", 1);
+	return NULL;
+}
+
+/* loop side: handle notifications from the parser */
+static void term_input(struct my_sess *sh)
+{
+	char buf[16];
+	int i, l, changed = 0, replies = 0;
+
+	while ( (l = read(sh->ctl[0], buf, sizeof(buf))) > 0) {
+		for (i = 0; i < l; i++) {
+			changed |= (buf[i] == 'n');
+			replies |= (buf[i] == 'k');
+		}
+	}
+	sh->notified = 0;
+	__sync_synchronize();
+	if (replies && sh->sess.fd >= 0)
+		term_replies(sh);
+	if (changed)
+		term_modified(sh);
+	if (sh->done) {
+		pthread_join(sh->thread, NULL);
+		sh->running = 0;
+		term_close(sh);
+	}
+}
+
+/* the child is gone, let the parser collect the last output and exit */
+static void term_drain(struct my_sess *sh)
+{
+	if (sh->running && !sh->stopping) {
+		sh->stopping = 1;
+		write(sh->ctl[0], "s", 1);
+	}
+}
+
+static int term_thread_start(struct my_sess *sh)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		snap_fill(sh, &sh->snap[i]);
+	sh->back = 0;
+	sh->mid = 1;
+	sh->front = 2;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sh->ctl))
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(sh->ctl[i], F_SETFL, O_NONBLOCK);
+		fcntl(sh->ctl[i], F_SETFD, 1 );	// close on exec
 	}
-	spos += l;
-	sh->sbuf[spos] = '\0';
-	DBG(2, "got %d bytes for %s\n", l, sh->name);
-	sh->modified = 1; /* maybe not... */
-	s = page_append(sh, sh->sbuf); /* returns unprocessed pointer */
-	strcpy(sh->sbuf, s);
+	if (pthread_create(&sh->thread, NULL, term_parser, sh))
+		return -1;
+	sh->running = 1;
+	sess_watch(&sh->sess, sh->ctl[0], SE_READ);
 	return 0;
 }
+#else /* !TERM_THREADS */
+/* the application did not end the frame in time, show it anyway */
+static void sync_timeout(void *arg)
+{
+	struct my_sess *sh = arg;
+
+	DBG(1, "sync timeout on %s\n", sh->name);
+	sh->sync = 0;
+	if (term_frame_due(sh))
+		term_modified(sh);
+}
+
+/* the flood interval ended, show the change held back */
+static void frame_late(void *arg)
+{
+	struct my_sess *sh = arg;
+
+	if (sh->late && term_frame_due(sh))
+		term_modified(sh);
+	sh->late = 0;
+}
+
+/* read from the pty, close it on errors */
+static void term_input(struct my_sess *sh)
+{
+	int ret = term_screen(sh);
+
+	if (ret < 0) { /* pty gone, wait for the child */
+		term_close(sh);
+		return;
+	}
+	if (term_frame_due(sh))
+		term_modified(sh);
+	/* in a flood, with flow control, wait for the consumer */
+	if (sh->flow && sh->flood && sh->modified) {
+		sh->throttled = 1;
+		sh->stats.throttles++;
+		DBG(2, "throttle %s\n", sh->name);
+		term_watch(sh);
+	}
+}
+
+/* the child is gone, collect its last output */
+static void term_drain(struct my_sess *sh)
+{
+	int i;
+
+	for (i = 0; i < DRAIN_READS && term_screen(sh) == 0; i++) ;
+	sh->sync = 0;	/* no end of frame will come */
+	timer_cancel(&sh->sync_due);
+	timer_cancel(&sh->frame_due);
+	if (page_changed(sh) || sh->frame)
+		term_modified(sh);
+	term_close(sh);
+}
+#endif /* !TERM_THREADS */
+
+/* the child terminated, record the status and wake up the session */
+static void term_exited(void *arg, int status)
+{
+	struct my_sess *sh = arg;
+
+	DBG(1, "shell %s pid %d exited, status 0x%x\n",
+		sh->name, sh->pid, status);
+	sh->status = status;
+	sess_ready(&sh->sess, SE_WAKEUP);
+}
 
 /*
- * Callback for I/O with the shell
+ * Callback for I/O with the shell.
+ * We are called when the pty is ready, when the child terminates,
+ * or on a wakeup for a session that failed to start.
  */
 int handle_shell(void *_s, struct cb_args *a)
 {
 	struct my_sess *sh = _s;
 
-	if (sh->sess.fd < 0) { /* dead */
-		if (a->run == 0)
-			return 0;
+	DBG(1, "poll %p %s\n", sh, sh->name);
+	if (sh->sess.fd >= 0 && (a->revents & SE_WRITE))
+		term_keyboard(sh);
+	if (sh->sess.fd >= 0 && (a->revents & SE_READ))
+		term_input(sh);
+	if (sh->status != -1 && sh->sess.fd >= 0)
+		term_drain(sh);
+	if (sh->sess.fd < 0 && (sh->status != -1 || sh->pid <= 0)) {
+		child_unwatch(&sh->child);
 		if (sh->cb)
-			sh->cb(_s);
+			sh->cb(_s, TE_DEAD);
+		sb_free(&sh->sb);
+		free(sh->alt);
+		free(sh->keys);
+#ifndef TERM_THREADS
+		timer_cancel(&sh->sync_due);
+		timer_cancel(&sh->frame_due);
+#endif
+#ifdef TERM_THREADS
+		pthread_mutex_destroy(&sh->sb_lock);
+		pthread_mutex_destroy(&sh->reply_lock);
+#endif
 		free(sh);	/* otherwise destroy */
 		return 1;
 	}
-	DBG(1, "poll %p %s\n", sh, sh->name);
-	if (a->run == 0) {
-		FD_SET(sh->sess.fd, a->r);
-		if (sh->klen)	/* have bytes to send to keyboard */
-			FD_SET(sh->sess.fd, a->w);
-		return 1;
-	}
-	if (FD_ISSET(sh->sess.fd, a->w))
-		term_keyboard(sh);
-	if (FD_ISSET(sh->sess.fd, a->r))
-		term_screen(sh); /* can close the fd. handle later */
 	return 0;
 }
 
+static char *term_type;	/* TERM for the children, see term_settype() */
+
+void term_settype(const char *type)
+{
+	free(term_type);
+	term_type = type ? strdup(type) : NULL;
+}
+
 /*
  * Create a "terminal" child process, and talk to it through a slave pty
  * using event-based sessions. "name" is the identifier.
  */
 struct sess *term_new(char *cmd, const char *name,
-	int rows, int cols, void (*cb)(struct sess *))
+	int rows, int cols, term_cb cb)
 {
-        int l, ln = strlen(name) + 1;
+        int l, ln = strlen(name) + 1, npages = 2, nrowgen = 1;
 	struct winsize ws;
 	struct my_sess *s;
 
-	if (rows < 4 || rows > 80)
+	if (rows < 4 || rows > MAX_ROWS)
 		rows = 25;
-	if (cols < 10 || cols > 160)
+	if (cols < 10 || cols > MAX_COLS)
 		cols = 80;
 	l = rows*cols;
     
 	DBG(1, "create shell %s %s %dx%d\n", name, cmd, rows, cols);
+#ifdef TERM_THREADS
+	npages += 2;	/* three snapshots instead of the export page */
+	nrowgen += 3;
+#endif
 	/* allocate space for page and attributes */
-        s = new_sess(sizeof(*s) + l*2 + ln, -2, handle_shell, NULL);
+        s = new_sess(sizeof(*s) + rows*sizeof(int) +
+		rows*sizeof(uint32_t)*nrowgen + l*sizeof(term_cell)*npages +
+		ln + TERM_BUFSIZE,
+		-2, handle_shell, NULL);
         if (!s) {
 		DBG(0, "failed to create session for %s\n", name);
 		return NULL;
 	}
 	s->cb = cb;
+	s->status = -1;
         s->rows = rows;
         s->cols = cols;
 	s->pagelen = s->rows * s->cols;
@@ -720,10 +2770,31 @@ struct sess *term_new(char *cmd, const char *name,
         s->cur = 0;
         s->cur_attr = 0;
  
-        s->name = (char *)(s + 1);
-        s->page = s->name + ln;	/* one set for chars, one for attributes */
+	s->rowmap = (int *)(s + 1);
+	for (l = 0; l < rows; l++)
+		s->rowmap[l] = l;
+	s->rowgen = (uint32_t *)(s->rowmap + rows);
+	s->gen = 1;
+	s->exp_cur = -2;	/* report the cursor on the first export */
+        s->page = (term_cell *)(s->rowgen + rows*nrowgen);
         erase(s, 0, s->pagelen);
+        s->name = (char *)(s->page + s->pagelen * npages);
         strcpy(s->name, name);
+	s->sbuf = s->name + ln;
+#ifndef TERM_THREADS
+	s->export = s->page + s->pagelen;
+	timer_init(&s->sync_due, sync_timeout, s);
+	timer_init(&s->frame_due, frame_late, s);
+#endif
+#ifdef TERM_THREADS
+	for (l = 0; l < 3; l++) {
+		s->snap[l].page = s->page + s->pagelen * (l + 1);
+		s->snap[l].rowgen = s->rowgen + rows * (l + 1);
+	}
+	s->ctl[0] = s->ctl[1] = -1;
+	pthread_mutex_init(&s->sb_lock, NULL);
+	pthread_mutex_init(&s->reply_lock, NULL);
+#endif
 
 	bzero(&ws, sizeof(ws));
 	ws.ws_row = rows;
@@ -734,15 +2805,30 @@ struct sess *term_new(char *cmd, const char *name,
 	    DBG(0, "forkpty failed\n");
 	    /* failed. mark session as dying, will be freed later */
 	    s->sess.fd = -1; /*mark as dying */
+	    sess_ready(&s->sess, SE_WAKEUP);
 	    return NULL;
 	}
 	if (s->pid == 0) { /* this is the child, execvp the shell */
 	    char *av[] = { cmd, "--login", NULL};
-	    //putenv("TERM=linux");
+	    sig_reset();
+	    if (term_type)
+		setenv("TERM", term_type, 1);
 	    execvp(av[0], av);
 	    exit(1); /* notreached normally */
 	}
 	fcntl(s->sess.fd, F_SETFL, O_NONBLOCK);
+	sess_watch(&s->sess, s->sess.fd, PTY_EVENTS);
+	s->child.pid = s->pid;
+	s->child.fn = term_exited;
+	s->child.arg = s;
+	child_watch(&s->child);
+#ifdef TERM_THREADS
+	if (term_thread_start(s)) {
+		DBG(0, "cannot start the parser for %s\n", name);
+		kill(s->pid, SIGKILL);
+		term_close(s);	/* dies when the child is reaped */
+	}
+#endif
         return (struct sess *)s;
 }
 
@@ -754,7 +2840,7 @@ const char *term_name(struct sess *s)
 int term_kill(struct sess *sess, int sig)
 {
 	struct my_sess *sh = (struct my_sess *)sess;
-	if (sh)
+	if (sh && sh->pid > 0 && sh->status == -1)
 		kill(sh->pid, sig);
 	return 0;
 }
@@ -35,12 +35,45 @@
  * and exporting the framebuffer.
  */
 
+/*
+ * Screen cells. The output is decoded as UTF-8 and each cell holds
+ * a codepoint and the attributes (see terminal.c) in 32 bits.
+ * A double width char sets CELL_WIDE, the next cell is CELL_CONT.
+ * CELL_MARKS means combining chars follow the codepoint, the exported
+ * screen lists them in term_state.marks.
+ */
+typedef uint32_t term_cell;
+#define CELL_CP		0x001fffff	/* codepoint */
+#define CELL_WIDE	0x00200000
+#define CELL_CONT	0x00400000
+#define CELL_MARKS	0x00800000
+#define CELL_ATTR_SHIFT	24
+#define CELL(cp, attr)	((term_cell)(cp) | (term_cell)(attr) << CELL_ATTR_SHIFT)
+#define CELL_ATTR(c)	((c) >> CELL_ATTR_SHIFT)
+
+/* combining chars, up to TERM_MARKS, on the cell at offset 'off' */
+#define TERM_MARKS	2
+struct term_mark {
+	int off;
+	uint32_t cp[TERM_MARKS];	/* 0 if unused */
+};
+
 /*
  * term_new creates a session, and possibly specifies a callback to invoke
- * on special events (typically destruction).
+ * on special events: TE_DEAD before destruction (term_state() then
+ * reports the exit status), TE_MODIFIED when the screen changes after
+ * the 'modified' flag was cleared.
  */
+enum { TE_DEAD = 1, TE_MODIFIED = 2 };
+typedef void (*term_cb)(struct sess *, int event);
 struct sess *term_new(char *cmd, const char *name,
-	int rows, int cols, void (*cb)(struct sess *));
+	int rows, int cols, term_cb cb);
+
+/*
+ * TERM for the children of later term_new() calls, NULL (the default)
+ * keeps ours. kiterm.ti describes what the emulator supports.
+ */
+void term_settype(const char *type);
 
 /* lookup a session by name */
 struct sess *term_find(const char *name);
@@ -48,27 +81,113 @@ struct sess *term_find(const char *name);
 /* return the name */
 const char *term_name(struct sess *s);
 
-/* send nul-terminated string to the terminal */
-int term_keyin(struct sess *, char *k);
+/*
+ * queue len bytes of input for the terminal. The queue grows as
+ * needed up to a limit, returns the bytes queued, fewer if it is
+ * full (see keys in struct term_stats), -1 if the pty is gone.
+ */
+int term_keyin(struct sess *, const char *k, int len);
 
 /* send a signal to the terminal session */
 int term_kill(struct sess *sh, int sig);
 
 /*
- * terminal state. The flags can be used to update modified, callback, name
- * when calling term_state(s, ptr) with a non-null ptr.
+ * Scrollback. Rows scrolled off the top of the screen are kept, up to
+ * 'lines' rows in about 'bytes' of memory, the oldest go first.
+ * term_scrollback() sets the limits and clears the history, lines = 0
+ * disables it (the default). Rows are numbered from the start of the
+ * session: term_state() reports in 'hist' the number of the row just
+ * above the screen plus one, and in 'hist_rows' how many are kept.
+ * term_sb_row() copies row 'n' to cols cells, and returns -1 if the
+ * row is not kept. Combining chars are not kept.
+ */
+int term_scrollback(struct sess *, int lines, int bytes);
+int term_sb_row(struct sess *, uint32_t n, term_cell *cells);
+
+/*
+ * Flood handling. When the child writes faster than we parse, the
+ * output is still parsed at full speed but TE_MODIFIED is sent at
+ * most every few hundred ms, until the pty backlog drains.
+ * With 'flow' set, we also stop reading the pty during a flood while
+ * the consumer has not fetched the last change with TS_MOD, so the
+ * kernel stops the child. Use it only for terminals being displayed.
+ */
+struct term_stats {
+	uint32_t dropped;	/* notifications skipped in floods */
+	uint32_t throttles;	/* reads stopped for the consumer */
+	int backlog;	/* bytes left in the pty after the last read */
+	int backlog_max;
+	int keys;	/* bytes queued for the pty, see term_keyin() */
+};
+
+/*
+ * terminal state. The flags can be used to update modified, callback,
+ * name, flow when calling term_state(s, ptr) with a non-null ptr.
  * For convenience, term_state() returns the 'modified' state.
+ * In a synchronized update (DEC mode 2026) it reports the last
+ * complete frame, and TE_MODIFIED waits for the frame to end.
  */
-enum { TS_MOD = 1, TS_CB = 2, TS_NAME = 4 };
+enum { TS_MOD = 1, TS_CB = 2, TS_NAME = 4, TS_FLOW = 8 };
 struct term_state {
 	int flags;
 	int modified, rows, cols, cur;
 	int pid;
-	void (*cb)(struct sess *);
+	int status;	/* exit status as from wait(2), -1 if running */
+	term_cb cb;
 	char *name;
-	char *data;
+	const term_cell *cells;	/* rows * cols */
+	const struct term_mark *marks;
+	int nmarks;
+	int flow;	/* pty backpressure, see struct term_stats */
+	struct term_stats stats;
+	/*
+	 * Change tracking. Each screen row records the generation of its
+	 * last change, and the generation advances on each call.
+	 * A consumer keeps 'gen' from its previous call (0 initially):
+	 * row r changed since then if rowgen[r] > gen, and the cursor
+	 * moved if cur_gen > gen. Any number of consumers can do this.
+	 */
+	uint32_t gen;
+	uint32_t cur_gen;
+	const uint32_t *rowgen;
+	uint32_t hist;	/* see term_scrollback() */
+	int hist_rows;
+	/*
+	 * Rows top..bottom-1 moved up by n rows (down if n < 0) in this
+	 * generation, e.g. in a scroll or a line insert. A consumer that
+	 * holds gen - 1 can move what it shows, then still redraw the
+	 * changed rows. n is 0 if there is nothing to move.
+	 */
+	struct term_move {
+		int top, bottom, n;
+	} move;
 };
 int term_state(struct sess *sh, struct term_state *ptr);
 
+static inline int term_row_changed(const struct term_state *st, int row,
+	uint32_t since)
+{
+	return st->rowgen[row] > since;
+}
+
+/*
+ * Search the scrollback and the screen of 'st', from the last
+ * term_state(). The screen rows are numbered from st->hist on.
+ * term_search() looks for 'pat' from row, col on (TSR_BACK: before
+ * col, then upwards) and fills *m with the first match, in cells.
+ * The rows are matched as UTF-8 text. Rows out of
+ * range start the search from the nearest end. Returns 0 if found,
+ * -1 otherwise or on bad patterns. Scrollback blocks that cannot
+ * contain the pattern are skipped with an index of their trigrams.
+ */
+enum { TSR_BACK = 1, TSR_REGEX = 2, TSR_ICASE = 4 };
+struct term_match {
+	uint32_t row;
+	int col, len;
+};
+int term_search(struct sess *, const struct term_state *st,
+	const char *pat, int flags, uint32_t row, int col,
+	struct term_match *m);
+
 
 #endif /* _TERMINAL_H* */
@@ -0,0 +1,144 @@
+/*
+ * Check of the replies to terminal queries, run with 'make test'.
+ *
+ * The program runs itself in a terminal session. The child sends
+ * each query in raw mode, reads the reply from its input and checks
+ * the bytes and the delay, then prints a report. The parent shows the
+ * screen when the child exits, and returns its exit status.
+ * Without replies, applications wait for their own timeout instead.
+ */
+
+#include "myts.h"
+#include "terminal.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#define ROWS	24
+#define COLS	80
+#define REPLY_MS	100	/* longest acceptable delay */
+#define TEST_MS	30000	/* the whole test */
+
+static const struct query {
+	const char *name, *q, *reply;
+} queries[] = {
+	{ "DA",		"\033[c",	"\033[?6c" },
+	{ "DA2",	"\033[>c",	"\033[>1;10;0c" },
+	{ "DSR",	"\033[5n",	"\033[0n" },
+	{ "CPR",	"\033[6n",	"\033[3;5R" },	/* see child() */
+	{ "DECXCPR",	"\033[?6n",	"\033[?3;5;1R" },
+	{ "DECRQM 25",	"\033[?25$p",	"\033[?25;1$y" },
+	{ "DECRQM 7",	"\033[?7$p",	"\033[?7;4$y" },
+	{ "DECRQM 4",	"\033[4$p",	"\033[4;2$y" },
+	{ "DECRQM 9999", "\033[?9999$p", "\033[?9999;0$y" },
+	{ "size",	"\033[18t",	"\033[8;24;80t" },
+};
+#define NQ	(sizeof(queries) / sizeof(queries[0]))
+
+static double now_ms_f(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* the reply to q in buf, at most len bytes, or what came in REPLY_MS */
+static int ask(const char *q, char *buf, int len)
+{
+	struct pollfd pfd = { 0, POLLIN, 0 };
+	double t0 = now_ms_f(), left;
+	int l, n = 0;
+
+	write(1, q, strlen(q));
+	while (n < len && (left = t0 + REPLY_MS * 10 - now_ms_f()) > 0 &&
+	    poll(&pfd, 1, (int)left + 1) > 0 &&
+	    (l = read(0, buf + n, len - n)) > 0)
+		n += l;
+	return n;
+}
+
+/* runs in the terminal, the replies come on stdin */
+static int child(void)
+{
+	struct termios t;
+	char buf[64], out[NQ][COLS];
+	int i, j, k, n, fails = 0;
+	double dt;
+
+	tcgetattr(0, &t);
+	cfmakeraw(&t);
+	tcsetattr(0, TCSANOW, &t);
+	write(1, "\033[3;5H", 6);	/* the cursor for CPR */
+	for (i = 0; i < NQ; i++) {
+		const struct query *q = queries + i;
+		int want = strlen(q->reply);
+
+		dt = now_ms_f();
+		n = ask(q->q, buf, want);
+		dt = now_ms_f() - dt;
+		k = snprintf(out[i], COLS, "%s %-12s %6.2f ms ",
+			n == want && !memcmp(buf, q->reply, n) &&
+			dt < REPLY_MS ? "ok  " : (fails++, "FAIL"), q->name, dt);
+		for (j = 0; j < n && k < COLS - 4; j++)	/* show the reply */
+			k += snprintf(out[i] + k, COLS - k,
+				buf[j] == 033 ? "\\E" : "%c", buf[j]);
+	}
+	printf("\033[H\033[2J");
+	for (i = 0; i < NQ; i++)
+		printf("%s\r\n", out[i]);
+	printf("termtest: %d queries, %d failures\r\n", (int)NQ, fails);
+	fflush(stdout);
+	return fails != 0;
+}
+
+static void done(struct sess *s, int ev)
+{
+	struct term_state st = { .flags = TS_MOD, .modified = 0 };
+	int r, c, l;
+
+	term_state(s, &st);
+	if (ev != TE_DEAD)
+		return;
+	for (r = 0; r < st.rows; r++) {
+		const term_cell *row = st.cells + r * st.cols;
+
+		for (l = st.cols; l > 0 && (row[l - 1] & CELL_CP) == ' '; l--) ;
+		for (c = 0; c < l; c++)
+			putchar(row[c] & CELL_CP & 0x7f);
+		if (l)
+			putchar('\n');
+	}
+	exit(WIFEXITED(st.status) ? WEXITSTATUS(st.status) : 1);
+}
+
+static void too_long(void *arg)
+{
+	fprintf(stderr, "termtest: no result after %d ms\n", TEST_MS);
+	exit(1);
+}
+
+static int start(void)
+{
+	static struct timer t;
+	static char self[256];
+	int l;
+
+	if (getenv("TERMTEST_CHILD"))
+		exit(child());
+	l = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (l <= 0)
+		exit(1);
+	self[l] = '\0';
+	setenv("TERMTEST_CHILD", "1", 1);
+	if (term_new(self, "termtest", ROWS, COLS, done) == NULL)
+		exit(1);
+	timer_init(&t, too_long, NULL);
+	timer_arm(&t, TEST_MS);
+	return 0;
+}
+
+struct app lpad = { .start = start };